@@ -0,0 +1,271 @@
+// Schemelet benchmarks. Each benchmark prints one line with its throughput.
+// Build with: g++ -O2 -pthread -o bench schemelet.cpp bench.cpp
+#include "schemelet.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <thread>
+
+using namespace sl;
+
+void printValue(Context&, Value*, int)
+{
+}
+
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char* name, double count, double seconds, const char* unit)
+{
+    printf("%-24s %10.2f M%s/s  (%.3f s)\n", name, count / seconds * 1e-6, unit, seconds);
+}
+
+// Short-lived pairs, collected every million allocations.
+static void benchAllocate()
+{
+    Context ctx;
+    const int n = 20000000;
+
+    double t = now();
+    for (int i = 0; i < n; i++)
+    {
+        ctx.makePair(ctx.makeInteger(i), ctx.nil());
+        if (i % 1000000 == 0)
+            ctx.gc();
+    }
+    ctx.gc();
+    report("allocate-pairs", n, now() - t, "allocs");
+}
+
+// A long list that survives, so collections have to mark and sweep it.
+static void benchRetained()
+{
+    Context ctx;
+    const int n = 1000000;
+
+    double t = now();
+    Handle<Pair> head(ctx, ctx.makePair(ctx.nil(), ctx.nil()));
+    Pair* tail = head;
+    for (int i = 0; i < n; i++)
+    {
+        Pair* p = ctx.makePair(ctx.makeInteger(i), ctx.nil());
+        tail->cdr = p;
+        tail = p;
+        ctx.makePair(ctx.nil(), ctx.nil()); // garbage
+    }
+    double t2 = now();
+    report("allocate-retained", 2 * n, t2 - t, "allocs");
+
+    for (int i = 0; i < 10; i++)
+        ctx.gc();
+    report("gc-retained", 10 * n, now() - t2, "objects");
+}
+
+// Collection pauses with a large old generation: a million retained pairs
+// and a hundred thousand fresh ones per collection.
+static void benchPause(const char* name, bool minor)
+{
+    Context ctx;
+    const int n = 1000000;
+    const int rounds = 20;
+
+    Handle<Value> list(ctx, ctx.nil());
+    for (int i = 0; i < n; i++)
+        list = ctx.makePair(ctx.makeInteger(i), list);
+    ctx.gc();
+
+    double total = 0;
+    for (int i = 0; i < rounds; i++)
+    {
+        for (int j = 0; j < n / 10; j++)
+            ctx.makePair(ctx.nil(), ctx.nil());
+        double t = now();
+        if (minor)
+            ctx.minorGC();
+        else
+            ctx.gc();
+        total += now() - t;
+    }
+    printf("%-24s %10.3f ms/collection\n", name, total / rounds * 1e3);
+}
+
+static Value* pairTree(Context& ctx, int depth)
+{
+    if (depth == 0)
+        return ctx.makeInteger(depth);
+    return ctx.makePair(pairTree(ctx, depth - 1), pairTree(ctx, depth - 1));
+}
+
+// Full collections of a graph with two million pairs in balanced trees, a
+// vector holding a list per slot, and a tree of closure environments, marked
+// by one thread and then by more. Nothing is freed, so the clear and sweep
+// cost is the same for every thread count and the differences are marking.
+static void benchParallelMark()
+{
+    Context ctx;
+
+    Handle<Vector> trees(ctx, ctx.newValue<Vector>());
+    for (int i = 0; i < 64; i++)
+        trees->values.push_back(pairTree(ctx, 15));
+
+    Handle<Vector> lists(ctx, ctx.newValue<Vector>());
+    for (int i = 0; i < 100000; i++)
+    {
+        Value* list = ctx.nil();
+        for (int j = 0; j < 8; j++)
+            list = ctx.makePair(ctx.makeNumber(j), list);
+        lists->values.push_back(list);
+    }
+
+    ctx.execute(
+        "(define tree (lambda (d) (if (= d 0) 0 ((lambda (l r) (lambda () (cons l r))) (tree (sub2 d 1)) (tree (sub2 d 1))))))"
+        "(define env-tree (tree 18))");
+
+    int maxThreads = std::max(4u, std::thread::hardware_concurrency());
+    double single = 0;
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        ctx.setMarkThreads(threads);
+        ctx.gc();
+        const int n = 5;
+        double t = now();
+        for (int i = 0; i < n; i++)
+            ctx.gc();
+        double seconds = (now() - t) / n;
+        if (threads == 1)
+            single = seconds;
+
+        char name[32];
+        snprintf(name, sizeof(name), "gc-mark-threads-%d", threads);
+        printf("%-24s %10.3f ms/collection  (%.2fx, %d values)\n", name, seconds * 1e3, single / seconds, ctx.getValueCount());
+    }
+}
+
+// Walking a list whose pairs were allocated between garbage, so they are
+// spread over many pages, and again after compaction packed them together.
+static double walk(Value* list, int rounds)
+{
+    double t = now();
+    long sum = 0;
+    for (int i = 0; i < rounds; i++)
+        for (Value* v = list; typeOf(v) == Value::PAIR; v = ((Pair*)v)->cdr)
+            sum += fixnumValue(((Pair*)v)->car);
+    if (sum == 42)
+        printf("\n");
+    return now() - t;
+}
+
+static void benchCompact()
+{
+    Context ctx;
+    const int n = 1000000;
+    const int rounds = 20;
+
+    Handle<Value> list(ctx, ctx.nil());
+    for (int i = 0; i < n; i++)
+    {
+        list = ctx.makePair(ctx.makeInteger(i), list);
+        for (int j = 0; j < 7; j++)
+            ctx.makePair(ctx.nil(), ctx.nil()); // garbage
+    }
+    ctx.gc();
+
+    report("walk-fragmented", (double)n * rounds, walk(list, rounds), "pairs");
+    double t = now();
+    ctx.compact();
+    double pause = now() - t;
+    report("walk-compacted", (double)n * rounds, walk(list, rounds), "pairs");
+    printf("%-24s %10.3f ms\n", "compact-pause", pause * 1e3);
+}
+
+// Allocation from Scheme code through the interpreter, collecting after
+// every hundred lists.
+static Value* collect(Context& ctx, int, Value**)
+{
+    ctx.gc();
+    return ctx.nil();
+}
+
+static void benchScheme()
+{
+    Context ctx;
+    ctx.define(ctx.sym("gc"), ctx.makeProcedure(collect));
+    const char* prog =
+        "(define build (lambda (n acc) (if (= n 0) acc (build (sub2 n 1) (cons n acc)))))"
+        "(define inner (lambda (i) (if (= i 0) 'done (begin (build 1000 '()) (inner (sub2 i 1))))))"
+        "(define outer (lambda (i) (if (= i 0) 'done (begin (inner 100) (gc) (outer (sub2 i 1))))))"
+        "(outer 50)";
+
+    double t = now();
+    ctx.execute(prog);
+    report("scheme-cons", 50 * 100 * 1000, now() - t, "conses");
+}
+
+// A tight loop of calls, variable references and branches that allocates
+// nothing but its frames, so the time is the interpreter's dispatch. Runs on
+// both machines, and on the register machine with the JIT too.
+static void benchLoop(Context::Backend backend, bool jit = false)
+{
+    Context ctx;
+    ctx.setBackend(backend);
+    ctx.setJitThreshold(jit ? 2 : 0);
+    const char* suffix = jit ? "-jit" : backend == Context::REGISTER_MACHINE ? "-registers" : "";
+    const int n = 5000000;
+    ctx.execute(
+        "(define loop (lambda (i acc) (if (= i 0) acc (loop (sub2 i 1) (add2 acc 2)))))"
+        "(define fib (lambda (n) (if (< n 2) n (add2 (fib (sub2 n 1)) (fib (sub2 n 2))))))");
+
+    char name[32];
+    double t = now();
+    ctx.execute("(loop 5000000 0)");
+    snprintf(name, sizeof(name), "scheme-loop%s", suffix);
+    report(name, n, now() - t, "iterations");
+
+    t = now();
+    ctx.execute("(fib 25)");
+    snprintf(name, sizeof(name), "scheme-fib%s", suffix);
+    report(name, 242785, now() - t, "calls");
+}
+
+// A loop in a closure nested three lambdas deep, adding a variable of the
+// outermost one and making a callback on every iteration.
+static void benchClosures()
+{
+    Context ctx;
+    const int n = 2000000;
+    ctx.execute(
+        "(define outer (lambda (a)"
+        "  (lambda (b)"
+        "    (lambda (c)"
+        "      (define loop (lambda (i acc) (if (= i 0) acc (loop (sub2 i 1) ((lambda (x) (add2 x a)) acc)))))"
+        "      loop))))"
+        "(define loop (((outer 1) 2) 3))");
+
+    double t = now();
+    ctx.execute("(loop 2000000 0)");
+    report("scheme-closures", n, now() - t, "iterations");
+}
+
+int main()
+{
+    for (int i = 0; i < 3; i++)
+    {
+        benchAllocate();
+        benchRetained();
+        benchScheme();
+        benchLoop(Context::STACK_MACHINE);
+        benchLoop(Context::REGISTER_MACHINE);
+        benchLoop(Context::REGISTER_MACHINE, true);
+        benchClosures();
+        benchPause("full-gc-pause", false);
+        benchPause("minor-gc-pause", true);
+        benchParallelMark();
+        benchCompact();
+    }
+    Context::printOpPairs();
+}
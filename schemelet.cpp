@@ -1,53 +1,143 @@
 #include "schemelet.hpp"
+#include <algorithm>
 #include <stack>
 #include <stdint.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// The JIT emits x86-64 code into pages from mmap().
+#if defined(__x86_64__) && defined(__unix__)
+#define SL_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 void printValue(sl::Context& ctx, sl::Value* v, int in);
+static sl::Value* parseBignum(sl::Context& ctx, const char* p, const char* end);
 
 using namespace sl;
 
-Context::Context() : nilValue(Value::NIL), trueValue(Value::BOOLEAN), falseValue(Value::BOOLEAN), omittedValue(Value::OMITTED), currentContinuation(0)
+Context::Context() : currentContinuation(0)
 {
-    valuesSinceLastGC = 0;
-    topEnv = makeEnv(0);
-    topEnv->incRef();
+    allocatedAtLastGC = 0;
+    liveBytesAfterFullGC = 0;
+    nurseryBytes = NURSERY_BYTES;
+    heapGrowth = 2;
+    phase = IDLE;
+    youngScanned = 0;
+    workPerByte = 0;
+    incrementBytes = INCREMENT_BYTES;
+    cycleLimit = 0;
+    incrementWork = 64 * 1024;
+    incrementMicros = 0;
+    markThreads = 1;
+    backend = STACK_MACHINE;
+    jitThreshold = 0;
+    perfMap = 0;
+#define SL_INIT_KEYWORD(m, s) m = sym(s);
+    SL_KEYWORDS(SL_INIT_KEYWORD)
+#undef SL_INIT_KEYWORD
+    topEnv = makeEnv(0, 0);
     initStandardLibrary();
 }
 
 Context::~Context()
 {
-    topEnv->decRef();
+    assert(handles.next == &handles); // handles must not outlive their Context
+    topEnv = 0;
     error = Error();
+    argBuffer.clear();
+#define SL_CLEAR_KEYWORD(m, s) m = 0;
+    SL_KEYWORDS(SL_CLEAR_KEYWORD)
+#undef SL_CLEAR_KEYWORD
     gc();
-    assert(values.empty());
+    assert(heap.count() == 0);
+    setPerfMap(false);
 }
 
 //
 // Symbols.
 //
 
-Symbol* Context::sym(const std::string& s)
+size_t Context::FoldHash::operator()(const std::string& s) const
+{
+    // FNV-1a over the lower-cased spelling.
+    size_t h = 2166136261u;
+    for (int i = 0; i < (int)s.length(); i++)
+        h = (h ^ (unsigned char)tolower((unsigned char)s[i])) * 16777619u;
+    return h;
+}
+
+bool Context::FoldEqual::operator()(const std::string& a, const std::string& b) const
+{
+    if (a.length() != b.length())
+        return false;
+    for (int i = 0; i < (int)a.length(); i++)
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i]))
+            return false;
+    return true;
+}
+
+Symbol* Context::intern(const std::string& s)
 {
-    for (int i = 0; i < (int)symbols.size(); i++)
-        if (strcasecmp(symbols[i]->s.c_str(), s.c_str()) == 0) // TODO: use tolower, strcasecmp is not portable
-            return symbols[i];
-    Symbol* sym = registerValue(new Symbol(s));
-    symbols.push_back(sym);
+    Symbol* sym = newValue<Symbol>(s);
+    symbols[s] = sym;
+    foldedSymbols.insert(std::make_pair(s, sym));
     return sym;
 }
 
+Symbol* Context::sym(const std::string& s)
+{
+    FoldedSymbolTable::const_iterator iter = foldedSymbols.find(s);
+    return (iter != foldedSymbols.end()) ? iter->second : intern(s);
+}
+
 Symbol* Context::symCase(const std::string& s)
 {
-    for (int i = 0; i < (int)symbols.size(); i++)
-        if (symbols[i]->s == s)
-            return symbols[i];
-    Symbol* sym = registerValue(new Symbol(s));
-    symbols.push_back(sym);
-    return sym;
+    SymbolTable::const_iterator iter = symbols.find(s);
+    return (iter != symbols.end()) ? iter->second : intern(s);
+}
+
+void Context::pruneSymbols()
+{
+    for (SymbolTable::iterator iter = symbols.begin(); iter != symbols.end(); )
+        if (iter->second->hasMark())
+            iter++;
+        else
+            iter = symbols.erase(iter);
+
+    bool lost = false;
+    for (FoldedSymbolTable::iterator iter = foldedSymbols.begin(); iter != foldedSymbols.end(); )
+        if (iter->second->hasMark())
+            iter++;
+        else
+        {
+            iter = foldedSymbols.erase(iter);
+            lost = true;
+        }
+
+    // A dead symbol may have shadowed a live one that differs only in case.
+    if (lost)
+        for (SymbolTable::iterator iter = symbols.begin(); iter != symbols.end(); iter++)
+            foldedSymbols.insert(*iter);
+}
+
+Global* Context::global(Symbol* s)
+{
+    std::map<Symbol*, Global*>::iterator iter = topEnv->globals.find(s);
+    if (iter != topEnv->globals.end())
+        return iter->second;
+    Global* g = newValue<Global>(s);
+    topEnv->globals[s] = g;
+    return g;
 }
 
 //
@@ -68,6 +158,16 @@ static bool isSymChar(int c)
            //(c && strchr("!$%&*-./:<=>?@^_~", c) != 0);
 }
 
+// Keeps strtod from reading identifiers such as inf or nan as numbers.
+static bool startsNumber(const char* p)
+{
+    if (*p == '+' || *p == '-')
+        p++;
+    if (*p == '.')
+        p++;
+    return *p >= '0' && *p <= '9';
+}
+
 static Value* recordPos(const char* p, std::map<Value*, const char*>* pos, Value* v)
 {
     if (pos)
@@ -77,12 +177,12 @@ static Value* recordPos(const char* p, std::map<Value*, const char*>* pos, Value
 
 static Value* reverse(Value* v, Value* tail)
 {
-    if (v->getType() == Value::PAIR)
+    if (typeOf(v) == Value::PAIR)
     {
         Value* cdr = v->getPair()->cdr;
         v->getPair()->cdr = tail;
 
-        return (cdr->getType() == Value::PAIR) ? reverse(cdr, v) : v;
+        return (typeOf(cdr) == Value::PAIR) ? reverse(cdr, v) : v;
     }
     else
         return v;
@@ -103,28 +203,23 @@ Value* Context::parseSExp(const char*& data, std::map<Value*, const char*>* pos)
 
     const char* start = data;
 
+    if (startsNumber(data))
     {
         const char* endd, *endl;
-        strtod(data, (char**)&endd);
+        double   d  = strtod(data, (char**)&endd);
         long int li = strtol(data, (char**)&endl, 0);
 
         if (endd > endl)
         {
-            Value* v = recordPos(start, pos, makePair(sym("unparsed-float"), makePair(makeString(std::string(start, endd)), nil())));
+            Value* v = recordPos(start, pos, makeNumber(d));
             data = endd;
             return v;
         }
 
-        if (li == LONG_MIN || li == LONG_MAX)
-        {
-            Value* v = recordPos(start, pos, makePair(sym("unparsed-int"), makePair(makeString(std::string(start, endl)), nil())));
-            data = endl;
-            return v;
-        }
-
         if (endl != data)
         {
-            Value* v = recordPos(start, pos, makeNumber(li));
+            bool overflow = li == LONG_MIN || li == LONG_MAX;
+            Value* v = recordPos(start, pos, overflow ? parseBignum(*this, start, endl) : makeInteger(li));
             data = endl;
             return v;
         }
@@ -132,21 +227,21 @@ Value* Context::parseSExp(const char*& data, std::map<Value*, const char*>* pos)
 
     if (*data == '\'' || *data == '`' || *data == ',')
     {
-        const char* q;
+        Symbol* q;
         if (*data == ',')
         {
             data++;
             if (*data == '@')
             {
                 data++;
-                q = "unquote-splicing";
+                q = symUnquoteSplicing;
             }
             else
-                q = "unquote";
+                q = symUnquote;
         }
         else
         {
-            q = (*data == '\'') ? "quote" : "quasiquote";
+            q = (*data == '\'') ? symQuote : symQuasiquote;
             data++;
         }
 
@@ -156,7 +251,7 @@ Value* Context::parseSExp(const char*& data, std::map<Value*, const char*>* pos)
 
         Value* v2 = recordPos(start, pos, nil());
         v  = recordPos(start, pos, makePair(v, v2));
-        v2 = recordPos(start, pos, sym(q));
+        v2 = recordPos(start, pos, q);
         v  = recordPos(start, pos, makePair(v2, v));
 
         return v;
@@ -239,8 +334,8 @@ Value* Context::parseSExp(const char*& data, std::map<Value*, const char*>* pos)
         // Prepare to handle (foo bar . baz) form.
 
         bool fixTail = false;
-        if (item->getType() == Value::PAIR && item->getPair()->cdr->getType() == Value::PAIR &&
-            item->getPair()->cdr->getPair()->car == sym("."))
+        if (typeOf(item) == Value::PAIR && typeOf(item->getPair()->cdr) == Value::PAIR &&
+            item->getPair()->cdr->getPair()->car == symDot)
         {
             item->getPair()->cdr = item->getPair()->cdr->getPair()->cdr;
             fixTail = true;
@@ -251,7 +346,7 @@ Value* Context::parseSExp(const char*& data, std::map<Value*, const char*>* pos)
         if (fixTail)
         {
             Value* v = item;
-            while (v->getPair()->cdr->getPair()->cdr->getType() == Value::PAIR)
+            while (typeOf(v->getPair()->cdr->getPair()->cdr) == Value::PAIR)
                 v = v->getPair()->cdr;
             v->getPair()->cdr = v->getPair()->cdr->getPair()->car;
         }
@@ -296,583 +391,4246 @@ Value* Context::parseSExpList(const char* start, Symbol* fid, std::map<Value*, F
 // Compile.
 //
 
+// Built-in procedures that calls by global name are compiled to ops for: the
+// op, the procedure and its argument count.
+#define SL_PRIMITIVES(X) \
+    X(PRIM_CAR,    car,   1) \
+    X(PRIM_CDR,    cdr,   1) \
+    X(PRIM_CONS,   cons,  2) \
+    X(PRIM_EQ,     eq,    2) \
+    X(PRIM_ADD,    add,   2) \
+    X(PRIM_SUB,    sub,   2) \
+    X(PRIM_LT,     lt,    2) \
+    X(PRIM_GT,     gt,    2) \
+    X(PRIM_LE,     le,    2) \
+    X(PRIM_GE,     ge,    2) \
+    X(PRIM_EQNUM,  eqnum, 2) \
+    X(PRIM_NULL,   null,  1) \
+    X(PRIM_PAIR,   pair,  1)
+
+#define SL_DECLARE_PRIMITIVE(op, name, n) static Value* s_##name(Context& ctx, int argc, Value** argv);
+SL_PRIMITIVES(SL_DECLARE_PRIMITIVE)
+#undef SL_DECLARE_PRIMITIVE
+
+// Returns the argument count of a PRIM_ op, or -1 for other ops.
+static int primitiveArgc(int type)
+{
+    switch (type)
+    {
+#define SL_PRIMITIVE_ARGC(op, name, n) case Code::op: return n;
+    SL_PRIMITIVES(SL_PRIMITIVE_ARGC)
+#undef SL_PRIMITIVE_ARGC
+    default: return -1;
+    }
+}
+
+// Returns the op for calling v with argc arguments, or NONE.
+static Code::OpType primitiveOp(Value* v, int argc)
+{
+    if (!v || typeOf(v) != Value::PROCEDURE)
+        return Code::NONE;
+    Procedure::proctype proc = v->getProcedure()->proc;
+#define SL_PRIMITIVE_OP(op, name, n) if (proc == s_##name && argc == n) return Code::op;
+    SL_PRIMITIVES(SL_PRIMITIVE_OP)
+#undef SL_PRIMITIVE_OP
+    return Code::NONE;
+}
+
 static bool testTailing(const Code& code, int i)
 {
-    if (i >= (int)code.ops.size())
+    if (code.ops[i].type == Code::RETURN)
         return true;
     else if (code.ops[i].type == Code::SKIP)
-        return testTailing(code, i + code.ops[i].i);
+        return testTailing(code, i + 1 + code.ops[i].i);
     else if (code.ops[i].type == Code::SKIP_IF_FALSE)
         return testTailing(code, i + 1) && testTailing(code, i + 1 + code.ops[i].i);
     else
         return false;
 }
 
+// Marks the calls that nothing follows as tail calls.
 static void tailAnalyze(Code& code)
 {
     for (int i = 0; i < (int)code.ops.size(); i++)
         if (code.ops[i].type == Code::APPLY && testTailing(code, i+1))
             code.ops[i].type = Code::TAIL_APPLY;
+        else if (primitiveArgc(code.ops[i].type) >= 0 && testTailing(code, i+1))
+            code.ops[i].i = 1;
 }
 
-Code* Context::compile(Value* v, const std::map<Value*, FilePos>& pos)
+static int skipTarget(const Code& code, int k)
 {
-    Code* code = makeCode();
-    compileBegin(*code, v, pos);
-    tailAnalyze(*code);
-
-    return code;
+    return k + 1 + code.ops[k].i;
 }
 
-static FilePos getPos(const std::map<Value*, FilePos>& pos, Value* v)
+static bool isSkip(const Code::Op& op)
 {
-    std::map<Value*, FilePos>::const_iterator iter = pos.find((Value*)v);
-    return (iter == pos.end()) ? FilePos() : iter->second;
+    return op.type == Code::SKIP || op.type == Code::SKIP_IF_FALSE;
 }
 
-void Context::compileBegin(Code& code, Value* v, const std::map<Value*, FilePos>& pos)
+static std::vector<bool> skipTargets(const Code& code)
 {
-    // TODO: simplify ret assignment, this control flow is horrible
-
-    bool ret = false;
-
-    while (v && v->getType() != Value::NIL)
-    {
-        if (ret)
-            code.emit(Code::POP, 0, 0, getPos(pos, v));
-        compile(code, v->getPair()->car, pos);
-        ret = true;
-
-        v = v->getPair()->cdr;
-    }
-
-    if (!ret)
-        code.emit(Code::PUSH, 0, nil(), getPos(pos, v));
+    std::vector<bool> targets(code.ops.size() + 1);
+    for (int k = 0; k < (int)code.ops.size(); k++)
+        if (isSkip(code.ops[k]))
+            targets[skipTarget(code, k)] = true;
+    return targets;
 }
 
-void Context::compile(Code& code, Value* v, const std::map<Value*, FilePos>& pos)
+// Threads skips through skips, drops ops that do nothing and results that
+// are popped right away, and folds branches on constants. Returns whether
+// anything changed.
+static bool simplify(Code& code)
 {
-    if (v->getType() == Value::SYMBOL)
-    {
-        code.emit(Code::LOOKUP, 0, v, getPos(pos, v));
-        return;
-    }
-
-    if (v->getType() != Value::PAIR)
-    {
-        code.emit(Code::PUSH, 0, v, getPos(pos, v));
-        return;
-    }
-
-    Pair* p = v->getPair();
-
-    // Built-in stuff.
-
-    Pair* cdr = (p->cdr->getType() == Value::PAIR) ? p->cdr->getPair() : 0;
-    Pair* cddr = (cdr && cdr->cdr->getType() == Value::PAIR) ? cdr->cdr->getPair() : 0;
-    Pair* cdddr = (cddr && cddr->cdr->getType() == Value::PAIR) ? cddr->cdr->getPair() : 0;
-    Value* car = p->car;
-    Value* cadr = cdr ? cdr->car : 0;
-    Value* caddr = cddr ? cddr->car : 0;
-    Value* cadddr = cdddr ? cdddr->car : 0;
-
-    if (car->getType() == Value::SYMBOL && car->getSymbol() == sym("begin"))
-    {
-        compileBegin(code, cdr, pos);
-        return;
-    }
+    std::vector<Code::Op>& ops = code.ops;
+    bool changed = false;
 
-    if (car->getType() == Value::SYMBOL && car->getSymbol() == sym("quote"))
+    for (int k = 0; k < (int)ops.size(); k++)
     {
-        if (!cadr)
+        if (!isSkip(ops[k]))
+            continue;
+        int t = skipTarget(code, k);
+        while (ops[t].type == Code::SKIP)
+            t = skipTarget(code, t);
+        if (ops[k].type == Code::SKIP && ops[t].type == Code::RETURN)
         {
-            setError(sym("bad-syntax"), 0, 0);
-            return;
+            ops[k].type = Code::RETURN;
+            ops[k].i = 0;
+            changed = true;
+        }
+        else if (t != skipTarget(code, k))
+        {
+            ops[k].i = t - k - 1;
+            changed = true;
         }
-        code.emit(Code::PUSH, 0, cadr, getPos(pos, v));
-        return;
     }
 
-    if (car->getType() == Value::SYMBOL && car->getSymbol() == sym("quasiquote"))
+    std::vector<bool> targets = skipTargets(code);
+    std::vector<bool> removed(ops.size());
+    for (int k = 0; k < (int)ops.size(); k++)
     {
-        if (!cadr)
+        Code::Op& op = ops[k];
+        bool last = k + 1 == (int)ops.size() || targets[k + 1];
+        if (op.type == Code::SKIP && op.i == 0)
+            removed[k] = true;
+        else if (last)
+            continue;
+        else if ((op.type == Code::DEFINE || op.type == Code::SET) && ops[k + 1].type == Code::POP)
         {
-            setError(sym("bad-syntax"), 0, 0);
-            return;
+            op.type = Code::DEFINE_DISCARD;
+            removed[++k] = true;
         }
-        bool ret = compileQuasiquote(code, cadr, pos);
-        assert(!ret);
-        return;
+        else if (op.type == Code::SET_LOCAL && ops[k + 1].type == Code::POP)
+        {
+            op.type = Code::SET_LOCAL_DISCARD;
+            removed[++k] = true;
+        }
+        else if (op.type == Code::PUSH && ops[k + 1].type == Code::SKIP_IF_FALSE)
+        {
+            removed[k] = true;
+            if (op.value == (Value*)Value::FALSE_BITS)
+                ops[k + 1].type = Code::SKIP;
+            else
+                removed[++k] = true;
+        }
+        else
+            continue;
+        changed = true;
     }
 
-    if (car->getType() == Value::SYMBOL && car->getSymbol() == sym("set!"))
+    // Skips over removed ops land on the next op that is kept.
+    std::vector<int> index(ops.size() + 1);
+    int n = 0;
+    for (int k = 0; k <= (int)ops.size(); k++)
     {
-        compile(code, caddr, pos);
-        code.emit(Code::SET, 0, cadr, getPos(pos, v));
-        return;
+        index[k] = n;
+        if (k < (int)ops.size() && !removed[k])
+            n++;
     }
-
-    if (car->getType() == Value::SYMBOL && car->getSymbol() == sym("define"))
+    for (int k = 0; k < (int)ops.size(); k++)
     {
-        compile(code, caddr, pos);
-        code.emit(Code::DEFINE, 0, cadr, getPos(pos, v));
-        return;
+        if (removed[k])
+            continue;
+        if (isSkip(ops[k]))
+            ops[k].i = index[skipTarget(code, k)] - index[k] - 1;
+        ops[index[k]] = ops[k];
+        code.pos[index[k]] = code.pos[k];
     }
+    ops.resize(n);
+    code.pos.resize(n);
+
+    return changed;
+}
+
+// Fuses pairs of ops that often follow each other, where no skip lands on
+// the second one.
+static void fuse(Code& code)
+{
+    std::vector<Code::Op>& ops = code.ops;
+    std::vector<bool> targets = skipTargets(code);
 
-    if (car->getType() == Value::SYMBOL && car->getSymbol() == sym("lambda"))
+    for (int k = 0; k + 1 < (int)ops.size(); k++)
     {
-        Code* code2 = makeCode();
+        if (targets[k + 1])
+            continue;
+        Code::OpType next = ops[k + 1].type;
+        bool apply = next == Code::APPLY || next == Code::TAIL_APPLY;
 
-        Value* arg = cadr;
-        while (arg->getType() == Value::PAIR)
+        switch (ops[k].type)
         {
-            code2->formals.push_back(arg->getPair()->car->getSymbol());
-            arg = arg->getPair()->cdr;
-        }
-
-        if (arg->getType() != Value::NIL)
-            code2->rest = arg->getSymbol();
+        case Code::LOOKUP:
+            if (next != Code::LOOKUP_LOCAL)
+                continue;
+            ops[k].type = Code::LOOKUP_LOOKUP_LOCAL;
+            break;
 
-        compileBegin(*code2, cddr, pos);
-        tailAnalyze(*code2);
+        case Code::LOOKUP_LOCAL:
+            if (!apply)
+                continue;
+            ops[k].type = Code::LOOKUP_LOCAL_APPLY;
+            break;
 
-        code.emit(Code::LAMBDA, 0, code2, getPos(pos, v));
+        case Code::PUSH:
+            if (!apply)
+                continue;
+            ops[k].type = Code::PUSH_APPLY;
+            break;
 
-        return;
+        default:
+            continue;
+        }
+        k++;
     }
+}
 
-    if (car->getType() == Value::SYMBOL && car->getSymbol() == sym("if"))
+// What an op has besides its type in the encoding, in this order. See
+// readLocal() for how locals are encoded.
+enum { OPERAND_I = 1, OPERAND_LOCAL = 2, OPERAND_VALUE = 4 };
+
+static int operands(Code::OpType t)
+{
+    switch (t)
     {
-        compile(code, cadr, pos);
+    case Code::NONE:
+    case Code::POP:
+    case Code::CONS:
+    case Code::SPLICING:
+    case Code::RETURN:
+        return 0;
 
-        int p0 = code.ops.size();
-        code.emit(Code::SKIP_IF_FALSE, 0, 0, getPos(pos, v));
+    case Code::APPLY:
+    case Code::TAIL_APPLY:
+    case Code::SKIP:
+    case Code::SKIP_IF_FALSE:
+        return OPERAND_I;
 
-        compile(code, caddr, pos);
+    case Code::LOOKUP_LOCAL:
+    case Code::SET_LOCAL:
+    case Code::LOOKUP_BOX:
+    case Code::SET_BOX:
+    case Code::SET_LOCAL_DISCARD:
+    case Code::LOOKUP_LOCAL_APPLY:
+        return OPERAND_LOCAL | OPERAND_VALUE;
 
-        int p1 = code.ops.size();
-        code.emit(Code::SKIP, 0, 0, getPos(pos, v));
+    case Code::LOOKUP:
+    case Code::PUSH:
+    case Code::DEFINE:
+    case Code::SET:
+    case Code::LAMBDA:
+    case Code::DEFINE_DISCARD:
+    case Code::LOOKUP_LOOKUP_LOCAL:
+    case Code::PUSH_APPLY:
+        return OPERAND_VALUE;
+
+    default:
+        assert(primitiveArgc(t) >= 0);
+        return OPERAND_I | OPERAND_VALUE;
+    }
+}
 
-        if (!cadddr)
-            code.emit(Code::PUSH, 0, nil(), getPos(pos, v));
-        else
-            compile(code, cadddr, pos);
+static int varintSize(unsigned v)
+{
+    int n = 1;
+    for (; v >= 0x80; v >>= 7)
+        n++;
+    return n;
+}
 
-        int p2 = code.ops.size();
+static void writeVarint(std::vector<uint8_t>& out, unsigned v)
+{
+    for (; v >= 0x80; v >>= 7)
+        out.push_back(uint8_t(v | 0x80));
+    out.push_back(uint8_t(v));
+}
 
-        code.ops[p0].i = p1 - p0;
-        code.ops[p1].i = p2 - p1 - 1;
-        return;
+// Operands are nearly always below 0x80, so only that case is inlined, and
+// nothing takes the address of the interpreter's ip.
+#ifdef __GNUC__
+#define SL_INLINE   inline __attribute__((always_inline))
+#define SL_NOINLINE __attribute__((noinline))
+#else
+#define SL_INLINE   inline
+#define SL_NOINLINE
+#endif
+
+static SL_NOINLINE const uint8_t* readLongVarint(const uint8_t* p, unsigned& v)
+{
+    v &= 0x7f;
+    for (int shift = 7; ; shift += 7)
+    {
+        unsigned b = *p++;
+        v |= (b & 0x7f) << shift;
+        if (b < 0x80)
+            return p;
     }
+}
+
+static SL_INLINE unsigned readVarint(const uint8_t*& p)
+{
+    unsigned v = *p++;
+    if (v >= 0x80)
+        p = readLongVarint(p, v);
+    return v;
+}
 
-    // Eval-apply.
+static SL_INLINE void skipVarint(const uint8_t*& p)
+{
+    while (*p++ & 0x80)
+        ;
+}
 
-    compile(code, car, pos);
-    v = cdr;
+// A local is the slot shifted up by three with the frame depth in the low
+// bits, and the rest of the depth in a second varint if it is 7 or more.
+static SL_INLINE void readLocal(const uint8_t*& p, int& depth, int& slot)
+{
+    unsigned v = readVarint(p);
+    depth = v & 7;
+    slot = v >> 3;
+    if (depth == 7)
+        depth += readVarint(p);
+}
 
-    int n = 0;
-    while (v && v->getType() == Value::PAIR)
+// The encoded size of op, with i and the constant index c as given.
+static int encodedSize(const Code::Op& op, int i, int c)
+{
+    int f = operands(op.type);
+    int n = 1;
+    if (f & OPERAND_I)
+        n += varintSize(i);
+    if (f & OPERAND_LOCAL)
     {
-        compile(code, v->getPair()->car, pos);
-        n++;
-        v = v->getPair()->cdr;
+        int depth = Code::localDepth(op.i);
+        n += varintSize(Code::localSlot(op.i) << 3 | std::min(depth, 7));
+        if (depth >= 7)
+            n += varintSize(depth - 7);
     }
+    if (f & OPERAND_VALUE)
+        n += varintSize(c);
+    return n;
+}
+
+// A run of ops from the same place. file is one more than the index of the
+// file name in constants, or 0 if there is none.
+struct PosRun
+{
+    int start;
+    int file;
+    int p;
+};
 
-    code.emit(Code::APPLY, n, 0, getPos(pos, v));
+static void addPosRun(std::vector<PosRun>& runs, int start, int file, int p)
+{
+    if (!runs.empty() && runs.back().file == file && runs.back().p == p)
+        return;
+    PosRun run = { start, file, p };
+    runs.push_back(run);
 }
 
-bool Context::compileQuasiquote(Code& code, Value* v, const std::map<Value*, FilePos>& pos)
+// Each run is written as how far it starts after the previous one, and then
+// the change of position, zigzagged, shifted up by one and with the low bit
+// set if the file changes too, in which case file follows.
+static void writePositions(std::vector<uint8_t>& out, const std::vector<PosRun>& runs)
 {
-    if (v->getType() == Value::PAIR)
+    PosRun last = { 0, 0, 0 };
+    for (int k = 0; k < (int)runs.size(); k++)
     {
-        if (v->getPair()->car->getType() == Value::SYMBOL && v->getPair()->car->getSymbol() == sym("unquote"))
-        {
-            compile(code, v->getPair()->cdr->getPair()->car, pos);
-        }
-        else if (v->getPair()->car->getType() == Value::SYMBOL && v->getPair()->car->getSymbol() == sym("unquote-splicing"))
-        {
-            compile(code, v->getPair()->cdr->getPair()->car, pos);
-            return true;
-        }
-        else
-        {
-            bool spliced = compileQuasiquote(code, v->getPair()->car, pos);
-            bool tmp = compileQuasiquote(code, v->getPair()->cdr, pos);
-            assert(!tmp);
-            if (spliced)
-                code.emit(Code::SPLICING, 0, 0, getPos(pos, v));
-            else
-                code.emit(Code::CONS, 0, 0, getPos(pos, v));
-        }
+        const PosRun& run = runs[k];
+        int d = run.p - last.p;
+        unsigned zigzag = (unsigned(d) << 1) ^ unsigned(d >> 31);
+        bool newFile = run.file != last.file;
+        writeVarint(out, run.start - last.start);
+        writeVarint(out, (zigzag << 1) | newFile);
+        if (newFile)
+            writeVarint(out, run.file);
+        last = run;
     }
-    else
-        code.emit(Code::PUSH, 0, v, getPos(pos, v));
-    return false;
 }
 
-//
-// Apply.
-//
+static void readPositions(const std::vector<uint8_t>& in, std::vector<PosRun>& runs)
+{
+    PosRun run = { 0, 0, 0 };
+    for (const uint8_t* p = in.data(); p < in.data() + in.size(); )
+    {
+        run.start += readVarint(p);
+        unsigned v = readVarint(p);
+        unsigned zigzag = v >> 1;
+        run.p += int(zigzag >> 1) ^ -int(zigzag & 1);
+        if (v & 1)
+            run.file = readVarint(p);
+        runs.push_back(run);
+    }
+}
 
-static Value* append(Context& ctx, Value* x, Value* y)
+// The position of the op at offset in code, from one of its position tables.
+static FilePos findPos(const Code& code, const std::vector<uint8_t>& positions, int offset)
 {
-    // TODO: do not use C stack for this operation, x might be arbitrarily huge
-    if (x->getType() == Value::PAIR)
-        return ctx.makePair(x->getPair()->car, append(ctx, x->getPair()->cdr, y));
-    else
-        return y;
+    std::vector<PosRun> runs;
+    readPositions(positions, runs);
+
+    FilePos pos;
+    for (int k = 0; k < (int)runs.size() && runs[k].start <= offset; k++)
+        pos = runs[k].file ? FilePos((Symbol*)code.constants[runs[k].file - 1], runs[k].p) : FilePos();
+    return pos;
 }
 
-void Context::step(Continuation* c)
+static int addConstant(Code& code, std::map<Value*, int>& index, Value* v)
 {
-    assert(!currentContinuation);
-    currentContinuation = c;
+    std::map<Value*, int>::iterator iter = index.find(v);
+    if (iter != index.end())
+        return iter->second;
+    index[v] = code.constants.size();
+    code.constants.push_back(v);
+    return code.constants.size() - 1;
+}
 
-#if 0
-    c->incRef();
-    gc();
-    c->decRef();
-#endif
+// Encodes ops into bytes, constants and positions, and drops ops and pos.
+static void encode(Code& code)
+{
+    const std::vector<Code::Op>& ops = code.ops;
+    int n = ops.size();
 
-    Continuation::Frame& f = c->frames.back();
-    const Code& code = *f.closure->code;
-    if (f.cp >= (int)code.ops.size())
+    std::map<Value*, int> index;
+    std::vector<int> constant(n);
+    std::vector<int> file(n);
+    for (int k = 0; k < n; k++)
     {
-        c->frames.pop_back();
-        currentContinuation = 0;
-        return;
+        if (operands(ops[k].type) & OPERAND_VALUE)
+            constant[k] = addConstant(code, index, ops[k].value);
+        if (code.pos[k].f)
+            file[k] = 1 + addConstant(code, index, code.pos[k].f);
     }
 
-    const Code::Op& op = code.ops[f.cp++];
-    std::vector<Value*>& st = c->stack;
-
-    switch (op.type)
+    // How many bytes a skip takes depends on how far it skips, so the layout
+    // is redone until no op grows.
+    std::vector<int> start(n + 1);
+    std::vector<int> size(n);
+    std::vector<int> i(n);
+    for (bool grown = true; grown; )
     {
-    case Code::NONE:
-        assert(!"weird");
-        break;
-
-    case Code::PUSH:
-        st.push_back(op.value);
-        break;
-
-    case Code::POP:
-        st.pop_back();
-        break;
-
-    case Code::LOOKUP:
+        grown = false;
+        for (int k = 0; k < n; k++)
+            start[k + 1] = start[k] + size[k];
+        for (int k = 0; k < n; k++)
         {
-            Value* v = f.env->findSymbol(op.value->getSymbol());
-            if (!v)
+            i[k] = isSkip(ops[k]) ? start[skipTarget(code, k)] - start[k + 1] : ops[k].i;
+            int s = encodedSize(ops[k], i[k], constant[k]);
+            if (s != size[k])
             {
-                setError(sym("undefined-identifier"), op.value, c);
-                return;
+                size[k] = s;
+                grown = true;
             }
-            assert(v);
-            st.push_back(v);
         }
-        break;
-
-    case Code::LAMBDA:
-        st.push_back(makeClosure(f.env, op.value->getCode()));
-        break;
+    }
 
-    case Code::DEFINE:
-        f.env->setSymbolLocal(op.value->getSymbol(), (Value*)st.back());
-        st.pop_back();
-        st.push_back(nil());
-        break;
+    std::vector<PosRun> runs;
+    code.bytes.reserve(start[n]);
+    for (int k = 0; k < n; k++)
+    {
+        int f = operands(ops[k].type);
+        code.bytes.push_back(uint8_t(ops[k].type));
+        if (f & OPERAND_I)
+            writeVarint(code.bytes, i[k]);
+        if (f & OPERAND_LOCAL)
+        {
+            int depth = Code::localDepth(ops[k].i);
+            writeVarint(code.bytes, Code::localSlot(ops[k].i) << 3 | std::min(depth, 7));
+            if (depth >= 7)
+                writeVarint(code.bytes, depth - 7);
+        }
+        if (f & OPERAND_VALUE)
+            writeVarint(code.bytes, constant[k]);
+        addPosRun(runs, start[k], file[k], code.pos[k].p);
+    }
+    assert((int)code.bytes.size() == start[n]);
+    writePositions(code.positions, runs);
 
-    case Code::SET:
-        // TODO: check that it is defined
-        f.env->setSymbol(op.value->getSymbol(), (Value*)st.back());
-        st.pop_back();
-        st.push_back(nil());
-        break;
+    std::vector<Code::Op>().swap(code.ops);
+    std::vector<FilePos>().swap(code.pos);
+}
 
-    case Code::SKIP_IF_FALSE:
-        if (st.back() == this->f())
-            f.cp += op.i;
-        st.pop_back();
+// Decodes bytes back into ops, with skips counting ops again, and gives the
+// byte each op starts at.
+static void decode(const Code& code, std::vector<Code::Op>& ops, std::vector<int>& start)
+{
+    const uint8_t* begin = code.bytes.data();
+    const uint8_t* end = begin + code.bytes.size();
+    ops.clear();
+    start.clear();
+    for (const uint8_t* p = begin; p < end; )
+    {
+        start.push_back(int(p - begin));
+        Code::Op op;
+        op.type = Code::OpType(*p++);
+        op.i = 0;
+        op.value = 0;
+        int f = operands(op.type);
+        if (f & OPERAND_I)
+            op.i = readVarint(p);
+        if (f & OPERAND_LOCAL)
+        {
+            int depth, slot;
+            readLocal(p, depth, slot);
+            op.i = Code::packLocal(depth, slot);
+        }
+        if (f & OPERAND_VALUE)
+            op.value = code.constants[readVarint(p)];
+        if (isSkip(op))
+            op.i += int(p - begin); // the byte it lands on, for now
+        ops.push_back(op);
+    }
+    start.push_back(int(end - begin));
+
+    for (int k = 0; k < (int)ops.size(); k++)
+        if (isSkip(ops[k]))
+            ops[k].i = int(std::lower_bound(start.begin(), start.end(), ops[k].i) - start.begin()) - k - 1;
+}
+
+// Whether frames of code can keep their locals on the stack. Closures copy
+// what they capture, so a frame is only shared by the continuations that
+// call/cc captures while it waits for a call to return. Those copy the
+// stack, which is the same as sharing unless the frame assigns a local
+// afterwards (boxed locals are shared through their boxes).
+static bool framesOnStack(const Code& code)
+{
+    bool assigns = false, waits = false;
+    for (int k = 0; k < (int)code.ops.size(); k++)
+    {
+        const Code::Op& op = code.ops[k];
+        if (op.type == Code::SET_LOCAL)
+            assigns = true;
+        else if (op.type == Code::APPLY || (primitiveArgc(op.type) >= 0 && !op.i))
+            waits = true;
+    }
+    return !(assigns && waits);
+}
+
+// How many values an op of the stack code adds to the stack. A fused op
+// counts as its first part, as the second one follows it.
+static int stackEffect(const Code::Op& op)
+{
+    switch (op.type)
+    {
+    case Code::PUSH:
+    case Code::LOOKUP:
+    case Code::LOOKUP_LOCAL:
+    case Code::LOOKUP_BOX:
+    case Code::LAMBDA:
+    case Code::LOOKUP_LOOKUP_LOCAL:
+    case Code::LOOKUP_LOCAL_APPLY:
+    case Code::PUSH_APPLY:
+        return 1;
+
+    case Code::POP:
+    case Code::DEFINE_DISCARD:
+    case Code::SET_LOCAL_DISCARD:
+    case Code::SKIP_IF_FALSE:
+    case Code::CONS:
+    case Code::SPLICING:
+        return -1;
+
+    case Code::APPLY:
+    case Code::TAIL_APPLY:
+        return -op.i;
+
+    case Code::NONE:
+    case Code::DEFINE:
+    case Code::SET:
+    case Code::SET_LOCAL:
+    case Code::SET_BOX:
+    case Code::SKIP:
+    case Code::RETURN:
+        return 0;
+
+    default:
+        return 1 - primitiveArgc(op.type);
+    }
+}
+
+static int maxStackDepth(const Code& code)
+{
+    std::vector<int> depthAt(code.ops.size() + 1, -1);
+    int d = 0;
+    int most = 0;
+    for (int k = 0; k < (int)code.ops.size(); k++)
+    {
+        const Code::Op& op = code.ops[k];
+        if (depthAt[k] >= 0)
+            d = depthAt[k];
+        if (d < 0)
+            continue;
+        d += stackEffect(op);
+        most = std::max(most, d);
+        if (isSkip(op))
+            depthAt[skipTarget(code, k)] = d;
+        if (op.type == Code::SKIP || op.type == Code::RETURN)
+            d = -1;
+    }
+    return most;
+}
+
+// Ends the code and rewrites it for run(). Run SL_OP_HISTOGRAM builds to see
+// which op pairs are worth fusing.
+static void finishCode(Code& code)
+{
+    code.emit(Code::RETURN, 0, 0, FilePos());
+    tailAnalyze(code);
+    code.onStack = framesOnStack(code);
+    while (simplify(code))
+        ;
+    fuse(code);
+    code.stackDepth = maxStackDepth(code);
+    encode(code);
+}
+
+// Makes the register format of finished code. Every op is given the depth of
+// the stack before it; skips carry their depth to the op they land on, and
+// ops after SKIP or RETURN that nothing skips to are dead and dropped.
+static void translateToRegisters(Code& code)
+{
+    std::vector<Code::Op> ops;
+    std::vector<int> start;
+    decode(code, ops, start);
+
+    std::vector<PosRun> runs, regRuns;
+    readPositions(code.positions, runs);
+    int run = 0;
+
+    std::vector<Code::RegOp>& regOps = code.regOps;
+    std::vector<int> index(ops.size() + 1); // first register op of each op
+    std::vector<int> depthAt(ops.size() + 1, -1);
+    int d = 0;
+    int registers = 0;
+
+    regOps.clear();
+    code.regPositions.clear();
+    for (int k = 0; k < (int)ops.size(); k++)
+    {
+        index[k] = regOps.size();
+        if (depthAt[k] >= 0)
+        {
+            assert(d < 0 || d == depthAt[k]);
+            d = depthAt[k];
+        }
+        if (d < 0)
+            continue;
+
+        const Code::Op& op = ops[k];
+        Code::RegOp r;
+        r.type = op.type;
+        r.dst = r.a = r.b = 0;
+        r.i = op.i;
+        r.value = op.value;
+
+        switch (op.type)
+        {
+        case Code::LOOKUP:
+        case Code::LOOKUP_LOOKUP_LOCAL:
+            r.type = Code::LOOKUP;
+            r.dst = d++;
+            break;
+
+        case Code::LOOKUP_LOCAL:
+        case Code::LOOKUP_LOCAL_APPLY:
+            r.type = Code::LOOKUP_LOCAL;
+            r.dst = d++;
+            break;
+
+        case Code::LOOKUP_BOX:
+            r.dst = d++;
+            break;
+
+        case Code::PUSH:
+        case Code::PUSH_APPLY:
+            r.type = Code::PUSH;
+            r.dst = d++;
+            break;
+
+        case Code::LAMBDA:
+            r.dst = d++;
+            break;
+
+        case Code::POP:
+            d--;
+            continue;
+
+        case Code::DEFINE:
+        case Code::SET:
+        case Code::SET_LOCAL:
+        case Code::SET_BOX:
+            r.dst = r.a = d - 1;
+            break;
+
+        // The nil goes to a register that is no longer used.
+        case Code::DEFINE_DISCARD:
+            r.type = Code::DEFINE;
+            r.dst = r.a = --d;
+            break;
+
+        case Code::SET_LOCAL_DISCARD:
+            r.type = Code::SET_LOCAL;
+            r.dst = r.a = --d;
+            break;
+
+        case Code::SKIP_IF_FALSE:
+            r.a = --d;
+            // fall through
+        case Code::SKIP:
+            {
+                int t = k + 1 + op.i;
+                assert(depthAt[t] < 0 || depthAt[t] == d);
+                depthAt[t] = d;
+                r.i = t; // an op index until all are known
+            }
+            break;
+
+        case Code::CONS:
+        case Code::SPLICING:
+            d--;
+            r.dst = r.a = d - 1;
+            r.b = d;
+            break;
+
+        case Code::APPLY:
+        case Code::TAIL_APPLY:
+            d -= op.i;
+            r.dst = r.a = d - 1;
+            assert(op.type == Code::APPLY || r.a == 0);
+            break;
+
+        case Code::RETURN:
+            r.a = d - 1;
+            break;
+
+        default:
+            {
+                int n = primitiveArgc(op.type);
+                assert(n >= 0);
+                d -= n;
+                r.dst = r.a = d++;
+                r.b = r.a + 1;
+                assert(!op.i || r.a == 0);
+            }
+            break;
+        }
+
+        registers = std::max(registers, d);
+        while (run + 1 < (int)runs.size() && runs[run + 1].start <= start[k])
+            run++;
+        if (!runs.empty())
+            addPosRun(regRuns, regOps.size(), runs[run].file, runs[run].p);
+        regOps.push_back(r);
+        if (op.type == Code::SKIP || op.type == Code::RETURN)
+            d = -1;
+    }
+    index[ops.size()] = regOps.size();
+
+    for (int k = 0; k < (int)regOps.size(); k++)
+        if (regOps[k].type == Code::SKIP || regOps[k].type == Code::SKIP_IF_FALSE)
+            regOps[k].i = index[regOps[k].i] - k - 1;
+    writePositions(code.regPositions, regRuns);
+    code.registers = registers;
+}
+
+Code* Context::compile(Value* v, const std::map<Value*, FilePos>& pos)
+{
+    Code* code = makeCode();
+    compileBegin(*code, 0, v, pos);
+    finishCode(*code);
+
+    return code;
+}
+
+static FilePos getPos(const std::map<Value*, FilePos>& pos, Value* v)
+{
+    std::map<Value*, FilePos>::const_iterator iter = pos.find((Value*)v);
+    return (iter == pos.end()) ? FilePos() : iter->second;
+}
+
+// Gives every name defined in a lambda body its own slot in the frame. Nested
+// lambdas and quoted data are not part of this frame and are skipped.
+void Context::collectDefines(Code& code, Value* v)
+{
+    while (v && typeOf(v) == Value::PAIR)
+    {
+        Value* form = v->getPair()->car;
+        v = v->getPair()->cdr;
+
+        if (typeOf(form) != Value::PAIR)
+            continue;
+
+        Pair* p = form->getPair();
+        if (p->car == symLambda || p->car == symQuote || p->car == symQuasiquote)
+            continue;
+
+        if (p->car == symDefine && typeOf(p->cdr) == Value::PAIR)
+        {
+            Value* name = p->cdr->getPair()->car;
+            if (typeOf(name) == Value::SYMBOL)
+            {
+                bool found = false;
+                for (int i = 0; i < (int)code.locals.size() && !found; i++)
+                    found = code.locals[i] == name;
+                if (!found)
+                    code.locals.push_back(name->getSymbol());
+            }
+            collectDefines(code, p->cdr->getPair()->cdr);
+        }
+        else
+            collectDefines(code, form);
+    }
+}
+
+// Notes how the forms in v use names: which are assigned and which occur in
+// nested lambdas. Names are not resolved, so a shadowing name counts too.
+void Context::scanUses(Value* v, bool nested, std::map<Symbol*, int>& uses)
+{
+    if (typeOf(v) == Value::SYMBOL)
+    {
+        if (nested)
+            uses[v->getSymbol()] |= USE_CAPTURED;
+        return;
+    }
+    if (typeOf(v) != Value::PAIR)
+        return;
+
+    Pair* p = v->getPair();
+    Value* cadr = typeOf(p->cdr) == Value::PAIR ? p->cdr->getPair()->car : 0;
+    if (p->car == symQuote)
+        return;
+    if (p->car == symLambda && cadr)
+    {
+        for (Value* b = p->cdr->getPair()->cdr; typeOf(b) == Value::PAIR; b = b->getPair()->cdr)
+            scanUses(b->getPair()->car, true, uses);
+        return;
+    }
+    if ((p->car == symSet || p->car == symDefine) && cadr && typeOf(cadr) == Value::SYMBOL)
+        uses[cadr->getSymbol()] |= USE_ASSIGNED;
+
+    for (; typeOf(v) == Value::PAIR; v = v->getPair()->cdr)
+        scanUses(v->getPair()->car, nested, uses);
+}
+
+// Boxes the locals that a nested lambda captures and that are assigned after
+// it may have copied them. Internal defines count as assignments, as the
+// lambdas that refer to them are often made before they are bound.
+void Context::findBoxes(Code& code, Value* body)
+{
+    std::map<Symbol*, int> uses;
+    for (; body && typeOf(body) == Value::PAIR; body = body->getPair()->cdr)
+        scanUses(body->getPair()->car, false, uses);
+
+    for (int slot = 0; slot < (int)code.locals.size(); slot++)
+    {
+        std::map<Symbol*, int>::iterator iter = uses.find(code.locals[slot]);
+        if (iter != uses.end() && iter->second == (USE_ASSIGNED | USE_CAPTURED))
+            code.boxes.push_back(slot);
+    }
+}
+
+// Finds s in the locals of the innermost lambda, or else in its captures. A
+// name that is local to an enclosing lambda becomes a capture of every
+// lambda in between.
+bool Context::resolveLocal(const Scope* scope, Symbol* s, int& i, bool& boxed)
+{
+    if (!scope)
+        return false;
+
+    Code& code = *scope->code;
+    for (int slot = (int)code.locals.size() - 1; slot >= 0; slot--)
+        if (code.locals[slot] == s)
+        {
+            i = Code::packLocal(0, slot);
+            boxed = std::find(code.boxes.begin(), code.boxes.end(), slot) != code.boxes.end();
+            return true;
+        }
+
+    for (int slot = 0; slot < (int)code.captures.size(); slot++)
+        if (code.captures[slot] == s)
+        {
+            i = Code::packLocal(1, slot);
+            boxed = code.boxedCaptures[slot];
+            return true;
+        }
+
+    int from;
+    if (!resolveLocal(scope->parent, s, from, boxed))
+        return false;
+    code.captures.push_back(s);
+    code.captureFrom.push_back(from);
+    code.boxedCaptures.push_back(boxed);
+    i = Code::packLocal(1, code.captures.size() - 1);
+    return true;
+}
+
+void Context::compileBegin(Code& code, const Scope* scope, Value* v, const std::map<Value*, FilePos>& pos)
+{
+    // TODO: simplify ret assignment, this control flow is horrible
+
+    bool ret = false;
+
+    while (v && typeOf(v) != Value::NIL)
+    {
+        if (ret)
+            code.emit(Code::POP, 0, 0, getPos(pos, v));
+        compile(code, scope, v->getPair()->car, pos);
+        ret = true;
+
+        v = v->getPair()->cdr;
+    }
+
+    if (!ret)
+        code.emit(Code::PUSH, 0, nil(), getPos(pos, v));
+}
+
+void Context::compile(Code& code, const Scope* scope, Value* v, const std::map<Value*, FilePos>& pos)
+{
+    if (typeOf(v) == Value::SYMBOL)
+    {
+        int i;
+        bool boxed;
+        if (resolveLocal(scope, v->getSymbol(), i, boxed))
+            code.emit(boxed ? Code::LOOKUP_BOX : Code::LOOKUP_LOCAL, i, v, getPos(pos, v));
+        else
+            code.emit(Code::LOOKUP, 0, global(v->getSymbol()), getPos(pos, v));
+        return;
+    }
+
+    if (typeOf(v) != Value::PAIR)
+    {
+        code.emit(Code::PUSH, 0, v, getPos(pos, v));
+        return;
+    }
+
+    Pair* p = v->getPair();
+
+    // Built-in stuff.
+
+    Pair* cdr = (typeOf(p->cdr) == Value::PAIR) ? p->cdr->getPair() : 0;
+    Pair* cddr = (cdr && typeOf(cdr->cdr) == Value::PAIR) ? cdr->cdr->getPair() : 0;
+    Pair* cdddr = (cddr && typeOf(cddr->cdr) == Value::PAIR) ? cddr->cdr->getPair() : 0;
+    Value* car = p->car;
+    Value* cadr = cdr ? cdr->car : 0;
+    Value* caddr = cddr ? cddr->car : 0;
+    Value* cadddr = cdddr ? cdddr->car : 0;
+
+    if (typeOf(car) == Value::SYMBOL && car->getSymbol() == symBegin)
+    {
+        compileBegin(code, scope, cdr, pos);
+        return;
+    }
+
+    if (typeOf(car) == Value::SYMBOL && car->getSymbol() == symQuote)
+    {
+        if (!cadr)
+        {
+            setError(symBadSyntax, 0, 0);
+            return;
+        }
+        code.emit(Code::PUSH, 0, cadr, getPos(pos, v));
+        return;
+    }
+
+    if (typeOf(car) == Value::SYMBOL && car->getSymbol() == symQuasiquote)
+    {
+        if (!cadr)
+        {
+            setError(symBadSyntax, 0, 0);
+            return;
+        }
+        bool ret = compileQuasiquote(code, scope, cadr, pos);
+        assert(!ret);
+        return;
+    }
+
+    if (typeOf(car) == Value::SYMBOL && car->getSymbol() == symSet)
+    {
+        compile(code, scope, caddr, pos);
+        int i;
+        bool boxed;
+        if (typeOf(cadr) == Value::SYMBOL && resolveLocal(scope, cadr->getSymbol(), i, boxed))
+        {
+            assert(boxed || Code::localDepth(i) == 0); // captures are copies
+            code.emit(boxed ? Code::SET_BOX : Code::SET_LOCAL, i, cadr, getPos(pos, v));
+        }
+        else if (typeOf(cadr) == Value::SYMBOL)
+            code.emit(Code::SET, 0, global(cadr->getSymbol()), getPos(pos, v));
+        else
+            setError(symBadSyntax, cadr, 0);
+        return;
+    }
+
+    if (typeOf(car) == Value::SYMBOL && car->getSymbol() == symDefine)
+    {
+        // Defines inside a lambda body were given a slot by collectDefines.
+        compile(code, scope, caddr, pos);
+        int i;
+        bool boxed;
+        if (scope && typeOf(cadr) == Value::SYMBOL && resolveLocal(scope, cadr->getSymbol(), i, boxed))
+            code.emit(boxed ? Code::SET_BOX : Code::SET_LOCAL, i, cadr, getPos(pos, v));
+        else if (typeOf(cadr) == Value::SYMBOL)
+            code.emit(Code::DEFINE, 0, global(cadr->getSymbol()), getPos(pos, v));
+        else
+            setError(symBadSyntax, cadr, 0);
+        return;
+    }
+
+    if (typeOf(car) == Value::SYMBOL && car->getSymbol() == symLambda)
+    {
+        Code* code2 = makeCode();
+
+        Value* arg = cadr;
+        while (typeOf(arg) == Value::PAIR)
+        {
+            code2->formals.push_back(arg->getPair()->car->getSymbol());
+            arg = arg->getPair()->cdr;
+        }
+
+        if (typeOf(arg) != Value::NIL)
+            code2->rest = arg->getSymbol();
+
+        code2->locals = code2->formals;
+        if (code2->rest)
+            code2->locals.push_back(code2->rest);
+        collectDefines(*code2, cddr);
+        findBoxes(*code2, cddr);
+
+        if ((int)code2->locals.size() > Code::MAX_LOCALS)
+        {
+            setError(symBadSyntax, cadr, 0);
+            return;
+        }
+
+        Scope scope2(scope, code2);
+        compileBegin(*code2, &scope2, cddr, pos);
+        if ((int)code2->captures.size() > Code::MAX_LOCALS)
+        {
+            setError(symBadSyntax, cadr, 0);
+            return;
+        }
+        finishCode(*code2);
+
+        code.emit(Code::LAMBDA, 0, code2, getPos(pos, v));
+
+        return;
+    }
+
+    if (typeOf(car) == Value::SYMBOL && car->getSymbol() == symIf)
+    {
+        compile(code, scope, cadr, pos);
+
+        int p0 = code.ops.size();
+        code.emit(Code::SKIP_IF_FALSE, 0, 0, getPos(pos, v));
+
+        compile(code, scope, caddr, pos);
+
+        int p1 = code.ops.size();
+        code.emit(Code::SKIP, 0, 0, getPos(pos, v));
+
+        if (!cadddr)
+            code.emit(Code::PUSH, 0, nil(), getPos(pos, v));
+        else
+            compile(code, scope, cadddr, pos);
+
+        int p2 = code.ops.size();
+
+        code.ops[p0].i = p1 - p0;
+        code.ops[p1].i = p2 - p1 - 1;
+        return;
+    }
+
+    // Eval-apply. A global name that holds a built-in procedure now is
+    // called through its PRIM_ op, which checks that it still does.
+
+    int n = 0;
+    for (Value* a = cdr; a && typeOf(a) == Value::PAIR; a = a->getPair()->cdr)
+        n++;
+
+    Code::OpType prim = Code::NONE;
+    int i;
+    bool boxed;
+    if (typeOf(car) == Value::SYMBOL && !resolveLocal(scope, car->getSymbol(), i, boxed))
+        prim = primitiveOp(global(car->getSymbol())->value, n);
+
+    if (prim == Code::NONE)
+        compile(code, scope, car, pos);
+
+    // Errors of the call are reported at the call form.
+    FilePos callPos = getPos(pos, v);
+    for (Value* a = cdr; a && typeOf(a) == Value::PAIR; a = a->getPair()->cdr)
+        compile(code, scope, a->getPair()->car, pos);
+
+    if (prim == Code::NONE)
+        code.emit(Code::APPLY, n, 0, callPos);
+    else
+        code.emit(prim, 0, global(car->getSymbol()), callPos);
+}
+
+bool Context::compileQuasiquote(Code& code, const Scope* scope, Value* v, const std::map<Value*, FilePos>& pos)
+{
+    if (typeOf(v) == Value::PAIR)
+    {
+        if (typeOf(v->getPair()->car) == Value::SYMBOL && v->getPair()->car->getSymbol() == symUnquote)
+        {
+            compile(code, scope, v->getPair()->cdr->getPair()->car, pos);
+        }
+        else if (typeOf(v->getPair()->car) == Value::SYMBOL && v->getPair()->car->getSymbol() == symUnquoteSplicing)
+        {
+            compile(code, scope, v->getPair()->cdr->getPair()->car, pos);
+            return true;
+        }
+        else
+        {
+            bool spliced = compileQuasiquote(code, scope, v->getPair()->car, pos);
+            bool tmp = compileQuasiquote(code, scope, v->getPair()->cdr, pos);
+            assert(!tmp);
+            if (spliced)
+                code.emit(Code::SPLICING, 0, 0, getPos(pos, v));
+            else
+                code.emit(Code::CONS, 0, 0, getPos(pos, v));
+        }
+    }
+    else
+        code.emit(Code::PUSH, 0, v, getPos(pos, v));
+    return false;
+}
+
+//
+// Apply.
+//
+
+static Value* append(Context& ctx, Value* x, Value* y)
+{
+    // TODO: do not use C stack for this operation, x might be arbitrarily huge
+    if (typeOf(x) == Value::PAIR)
+        return ctx.makePair(x->getPair()->car, append(ctx, x->getPair()->cdr, y));
+    else
+        return y;
+}
+
+#ifdef SL_OP_HISTOGRAM
+static unsigned long opPairs[Code::NUM_OPS][Code::NUM_OPS];
+static int lastOp;
+#define SL_COUNT_OP(t) (opPairs[lastOp][t]++, lastOp = (t))
+#else
+#define SL_COUNT_OP(t) ((void)0)
+#endif
+
+void Context::printOpPairs(int max)
+{
+#ifdef SL_OP_HISTOGRAM
+#define SL_OP_NAME(t) #t,
+    static const char* const names[] = { SL_OPS(SL_OP_NAME) };
+#undef SL_OP_NAME
+
+    std::vector<std::pair<unsigned long, int> > pairs;
+    unsigned long total = 0;
+    for (int i = 0; i < Code::NUM_OPS; i++)
+        for (int j = 0; j < Code::NUM_OPS; j++)
+            if (opPairs[i][j])
+            {
+                pairs.push_back(std::make_pair(opPairs[i][j], i * Code::NUM_OPS + j));
+                total += opPairs[i][j];
+            }
+    std::sort(pairs.rbegin(), pairs.rend());
+
+    for (int i = 0; i < (int)pairs.size() && i < max; i++)
+    {
+        int a = pairs[i].second / Code::NUM_OPS;
+        int b = pairs[i].second % Code::NUM_OPS;
+        printf("%-20s %-20s %12lu %6.2f%%\n", names[a], names[b], pairs[i].first, 100.0 * pairs[i].first / total);
+    }
+#else
+    (void)max;
+#endif
+}
+
+static inline bool fixnumAdd(Value* a, Value* b, Value*& r);
+static inline bool fixnumSub(Value* a, Value* b, Value*& r);
+
+// Whether the Global cell of a PRIM_ op still holds the built-in procedure.
+static inline bool isBuiltin(Value* cell, Procedure::proctype proc)
+{
+    Value* v = ((Global*)cell)->value;
+    return v && typeOf(v) == Value::PROCEDURE && ((Procedure*)v)->proc == proc;
+}
+
+// Runs c until its last frame returns or an error is set.
+void Context::run(Continuation* c)
+{
+    assert(!currentContinuation);
+    currentContinuation = c;
+
+    // Ops write to c's stack without barriers, so an old c has to stay in
+    // the remembered set. Collections empty the set, so c is put back after
+    // anything that may have collected.
+    if (collectionDue())
+        collect();
+    if (c->isOld())
+        heap.remember(c);
+
+    if (backend == REGISTER_MACHINE)
+        runRegisters(c);
+    else
+        runStack(c);
+
+    currentContinuation = 0;
+}
+
+// The position in the current frame is kept in locals and only written back
+// to the frame when something else may look at it: on calls, which may
+// capture the continuation or collect, and on errors. Each handler reads its
+// own operands, so ip is past them once it runs.
+void Context::runStack(Continuation* c)
+{
+    std::vector<Value*>& st = c->stack;
+    Continuation::Frame* frame;
+    const uint8_t*       ip;
+    Value* const*        constants;
+    Value**              scopes[2];    // the locals and the captures
+    int                  type;
+    int                  depth, slot;  // of a local
+    Value*               value;        // the constant operand
+    int                  argc;
+    bool                 tail;
+
+// Locals on the stack stay put while the frame runs, as the stack has room
+// for all that the frame pushes.
+#define SL_LOAD_FRAME() \
+    do \
+    { \
+        frame = &c->frames.back(); \
+        Code* code = frame->closure->code; \
+        ip = code->bytes.data() + frame->cp; \
+        constants = code->constants.data(); \
+        if (!frame->env) \
+        { \
+            size_t end = frame->base + 2 + code->locals.size() + code->stackDepth; \
+            if (st.capacity() < end) \
+                st.reserve(2 * end); \
+        } \
+        scopes[0] = frame->env ? frame->env->slots.data() : st.data() + frame->base + 1; \
+        scopes[1] = frame->closure->env ? frame->closure->env->slots.data() : 0; \
+    } while (0)
+#define SL_SAVE_FRAME() (frame->cp = int(ip - frame->closure->code->bytes.data()))
+#define SL_VALUE()      (value = constants[readVarint(ip)])
+#define SL_LOCAL()      readLocal(ip, depth, slot)
+
+#ifdef __GNUC__
+    // Direct threading: each handler jumps straight to the next op's one.
+#define SL_OP_HANDLER(t) &&op_##t,
+    static void* const handlers[] = { SL_OPS(SL_OP_HANDLER) };
+#undef SL_OP_HANDLER
+#define SL_NEXT() do { type = *ip++; SL_COUNT_OP(type); goto *handlers[type]; } while (0)
+#define SL_OP(t) case Code::t: op_##t
+#else
+#define SL_NEXT() goto dispatch
+#define SL_OP(t) case Code::t
+#endif
+
+    SL_LOAD_FRAME();
+
+dispatch:
+    type = *ip++;
+    SL_COUNT_OP(type);
+    switch (type)
+    {
+    SL_OP(NONE):
+    default:
+        assert(!"weird");
+        SL_NEXT();
+
+    SL_OP(RETURN):
+        if (!frame->env)
+        {
+            Value* v = st.back();
+            st.resize(frame->base);
+            st.push_back(v);
+        }
+        c->frames.pop_back();
+        if (c->frames.empty())
+            goto done;
+        SL_LOAD_FRAME();
+        goto dispatch;
+
+    SL_OP(PUSH):
+        st.push_back(SL_VALUE());
+        SL_NEXT();
+
+    SL_OP(POP):
+        st.pop_back();
+        SL_NEXT();
+
+    SL_OP(LOOKUP):
+        {
+            Value* v = SL_VALUE()->getGlobal()->value;
+            if (!v)
+            {
+                SL_SAVE_FRAME();
+                setError(symUndefinedIdentifier, value->getGlobal()->sym, c);
+                goto done;
+            }
+            st.push_back(v);
+        }
+        SL_NEXT();
+
+    SL_OP(LOOKUP_LOCAL):
+    lookupLocal:
+        {
+            SL_LOCAL();
+            Value* v = scopes[depth][slot];
+            if (!v)
+            {
+                SL_VALUE();
+                SL_SAVE_FRAME();
+                setError(symUndefinedIdentifier, value, c);
+                goto done;
+            }
+            skipVarint(ip); // the name, only for errors
+            st.push_back(v);
+        }
+        SL_NEXT();
+
+    SL_OP(LOOKUP_BOX):
+        {
+            SL_LOCAL();
+            Value* v = ((Pair*)scopes[depth][slot])->car;
+            if (!v)
+            {
+                SL_VALUE();
+                SL_SAVE_FRAME();
+                setError(symUndefinedIdentifier, value, c);
+                goto done;
+            }
+            skipVarint(ip);
+            st.push_back(v);
+        }
+        SL_NEXT();
+
+    SL_OP(SET_BOX):
+        {
+            SL_LOCAL();
+            skipVarint(ip);
+            Pair* box = (Pair*)scopes[depth][slot];
+            box->car = st.back();
+            writeBarrier(box, st.back());
+        }
+        st.back() = nil();
+        SL_NEXT();
+
+    SL_OP(LAMBDA):
+        st.push_back(makeFlatClosure(scopes, SL_VALUE()->getCode()));
+        SL_NEXT();
+
+    SL_OP(DEFINE):
+    SL_OP(SET):
+        // TODO: check that it is defined
+        SL_VALUE()->getGlobal()->value = st.back();
+        writeBarrier(value, st.back());
+        st.back() = nil();
+        SL_NEXT();
+
+    SL_OP(SET_LOCAL):
+        {
+            SL_LOCAL();
+            skipVarint(ip);
+            scopes[depth][slot] = st.back();
+            if (frame->env)
+                writeBarrier(frame->env, st.back());
+        }
+        st.back() = nil();
+        SL_NEXT();
+
+    SL_OP(DEFINE_DISCARD):
+        SL_VALUE()->getGlobal()->value = st.back();
+        writeBarrier(value, st.back());
+        st.pop_back();
+        SL_NEXT();
+
+    SL_OP(SET_LOCAL_DISCARD):
+        {
+            SL_LOCAL();
+            skipVarint(ip);
+            scopes[depth][slot] = st.back();
+            if (frame->env)
+                writeBarrier(frame->env, st.back());
+        }
+        st.pop_back();
+        SL_NEXT();
+
+    SL_OP(LOOKUP_LOOKUP_LOCAL):
+        {
+            Value* v = SL_VALUE()->getGlobal()->value;
+            if (!v)
+            {
+                SL_SAVE_FRAME();
+                setError(symUndefinedIdentifier, value->getGlobal()->sym, c);
+                goto done;
+            }
+            st.push_back(v);
+        }
+        type = *ip++;
+        goto lookupLocal;
+
+    SL_OP(LOOKUP_LOCAL_APPLY):
+        {
+            SL_LOCAL();
+            Value* v = scopes[depth][slot];
+            if (!v)
+            {
+                SL_VALUE();
+                SL_SAVE_FRAME();
+                setError(symUndefinedIdentifier, value, c);
+                goto done;
+            }
+            skipVarint(ip); // the name, only for errors
+            st.push_back(v);
+        }
+        type = *ip++;
+        goto applyOp;
+
+    SL_OP(PUSH_APPLY):
+        st.push_back(SL_VALUE());
+        type = *ip++;
+        goto applyOp;
+
+    // The tail flag and the Global cell come first.
+#define SL_PRIM_OPERANDS() (tail = readVarint(ip), SL_VALUE())
+
+    SL_OP(PRIM_CAR):
+        SL_PRIM_OPERANDS();
+        if (isBuiltin(value, s_car) && typeOf(st.back()) == Value::PAIR)
+        {
+            st.back() = ((Pair*)st.back())->car;
+            SL_NEXT();
+        }
+        goto primitiveCall;
+
+    SL_OP(PRIM_CDR):
+        SL_PRIM_OPERANDS();
+        if (isBuiltin(value, s_cdr) && typeOf(st.back()) == Value::PAIR)
+        {
+            st.back() = ((Pair*)st.back())->cdr;
+            SL_NEXT();
+        }
+        goto primitiveCall;
+
+    SL_OP(PRIM_CONS):
+        SL_PRIM_OPERANDS();
+        if (isBuiltin(value, s_cons))
+        {
+            Value* cdr = st.back();
+            st.pop_back();
+            st.back() = makePair(st.back(), cdr);
+            SL_NEXT();
+        }
+        goto primitiveCall;
+
+    SL_OP(PRIM_EQ):
+        SL_PRIM_OPERANDS();
+        if (isBuiltin(value, s_eq))
+        {
+            Value* b = st.back();
+            st.pop_back();
+            st.back() = makeBoolean(st.back() == b);
+            SL_NEXT();
+        }
+        goto primitiveCall;
+
+#define SL_ARITH_OP(t, name, fixnumOp) \
+    SL_OP(t): \
+        SL_PRIM_OPERANDS(); \
+        { \
+            Value* a = st.end()[-2]; \
+            Value* b = st.back(); \
+            Value* r; \
+            if (isBuiltin(value, s_##name) && Value::isFixnum(a) && Value::isFixnum(b) && fixnumOp(a, b, r)) \
+            { \
+                st.pop_back(); \
+                st.back() = r; \
+                SL_NEXT(); \
+            } \
+        } \
+        goto primitiveCall;
+
+#define SL_COMPARE_OP(t, name, o) \
+    SL_OP(t): \
+        SL_PRIM_OPERANDS(); \
+        { \
+            Value* a = st.end()[-2]; \
+            Value* b = st.back(); \
+            if (isBuiltin(value, s_##name) && Value::isFixnum(a) && Value::isFixnum(b)) \
+            { \
+                st.pop_back(); \
+                st.back() = makeBoolean((intptr_t)a o (intptr_t)b); \
+                SL_NEXT(); \
+            } \
+        } \
+        goto primitiveCall;
+
+    SL_ARITH_OP(PRIM_ADD, add, fixnumAdd)
+    SL_ARITH_OP(PRIM_SUB, sub, fixnumSub)
+    SL_COMPARE_OP(PRIM_LT,    lt,    <)
+    SL_COMPARE_OP(PRIM_GT,    gt,    >)
+    SL_COMPARE_OP(PRIM_LE,    le,    <=)
+    SL_COMPARE_OP(PRIM_GE,    ge,    >=)
+    SL_COMPARE_OP(PRIM_EQNUM, eqnum, ==)
+#undef SL_ARITH_OP
+#undef SL_COMPARE_OP
+
+    SL_OP(PRIM_NULL):
+        SL_PRIM_OPERANDS();
+        if (isBuiltin(value, s_null))
+        {
+            st.back() = makeBoolean(typeOf(st.back()) == Value::NIL);
+            SL_NEXT();
+        }
+        goto primitiveCall;
+
+    SL_OP(PRIM_PAIR):
+        SL_PRIM_OPERANDS();
+        if (isBuiltin(value, s_pair))
+        {
+            st.back() = makeBoolean(typeOf(st.back()) == Value::PAIR);
+            SL_NEXT();
+        }
+        goto primitiveCall;
+#undef SL_PRIM_OPERANDS
+
+    primitiveCall:
+        // The name was redefined, or the arguments need the full procedure
+        // with its type checks and errors: call what the cell holds.
+        argc = primitiveArgc(Code::OpType(type));
+        st.insert(st.end() - argc, value->getGlobal()->value);
+        goto apply;
+
+    SL_OP(SKIP_IF_FALSE):
+        {
+            int n = readVarint(ip);
+            if (st.back() == f())
+                ip += n;
+        }
+        st.pop_back();
+        SL_NEXT();
+
+    SL_OP(SKIP):
+        {
+            int n = readVarint(ip);
+            ip += n;
+        }
+        SL_NEXT();
+
+    SL_OP(CONS):
+        {
+            Value* cdr = st.back();
+            st.pop_back();
+            st.back() = makePair(st.back(), cdr);
+        }
+        SL_NEXT();
+
+    SL_OP(SPLICING):
+        {
+            Value* tail = st.back();
+            st.pop_back();
+            st.back() = append(*this, st.back(), tail);
+        }
+        SL_NEXT();
+
+    SL_OP(APPLY):
+    SL_OP(TAIL_APPLY):
+    applyOp:
+        argc = readVarint(ip);
+        tail = type == Code::TAIL_APPLY;
+    apply:
+        {
+            // Arguments are taken straight from the stack; no list is built
+            // unless the callee has a rest parameter.
+            int    base   = st.size() - argc - 1;
+            Value* callee = st[base];
+
+            // Nothing is left to do in this frame after a tail call, so drop
+            // it before applying. A closure then takes its place, a procedure
+            // returns straight to our caller and a continuation replaces the
+            // whole chain anyway. Locals on the stack go with it.
+            SL_SAVE_FRAME();
+            if (tail && base != frame->base)
+            {
+                std::copy(st.begin() + base, st.end(), st.begin() + frame->base);
+                base = frame->base;
+                st.resize(base + 1 + argc);
+            }
+            if (typeOf(callee) == Value::CLOSURE)
+            {
+                Continuation::Frame f2 = applyClosure(st, base, argc);
+                if (hasError())
+                    goto done;
+                if (tail)
+                    c->frames.pop_back();
+                c->frames.push_back(f2);
+            }
+            else
+            {
+                // A frame dropped for a tail call is put back if the
+                // procedure fails, so that the error is reported at the
+                // call. The procedure may collect, so its closure is kept.
+                Handle<Closure> caller(*this, tail ? frame->closure : 0);
+                int callerCp = frame->cp;
+                argBuffer.assign(st.begin() + base + 1, st.end());
+                st.resize(base);
+                if (tail)
+                    c->frames.pop_back();
+                apply(callee, argc, argBuffer.empty() ? 0 : &argBuffer[0]);
+                if (hasError())
+                {
+                    if (caller && error.continuation == c)
+                    {
+                        Continuation::Frame f(0, caller);
+                        f.cp = callerCp;
+                        f.base = st.size();
+                        c->frames.push_back(f);
+                    }
+                    goto done;
+                }
+                if (c->isOld())
+                    heap.remember(c); // the procedure may have collected
+                if (c->frames.empty())
+                    goto done;
+            }
+
+            // Everything live is reachable from c here.
+            if (collectionDue())
+            {
+                collect();
+                if (c->isOld())
+                    heap.remember(c);
+            }
+        }
+        SL_LOAD_FRAME();
+        goto dispatch;
+    }
+
+done:
+#undef SL_OP
+#undef SL_NEXT
+#undef SL_LOCAL
+#undef SL_VALUE
+#undef SL_SAVE_FRAME
+#undef SL_LOAD_FRAME
+    return;
+}
+
+// Runs the register format. While a frame runs, the stack reaches at least
+// to the end of its registers. At calls and returns it is cut back to where
+// the stack machine would have it, so procedures, continuations and errors
+// see the same stack on both machines: the result of a call is pushed to
+// where its callee was, which is the register it is wanted in.
+void Context::runRegisters(Continuation* c)
+{
+    std::vector<Value*>& st = c->stack;
+    Continuation::Frame* frame;
+    const Code::RegOp*   ops;
+    const Code::RegOp*   ip;
+    const Code::RegOp*   op;
+    Value**              scopes[2]; // the locals and the captures
+    Value**              r;         // the frame's registers
+    Value*               callee;
+    Value**              args;
+    int                  argc;
+    int                  dst;
+    bool                 tail;
+
+#define SL_LOAD_FRAME() \
+    do \
+    { \
+        frame = &c->frames.back(); \
+        Code* code = frame->closure->code; \
+        if (code->regOps.empty()) \
+            translateToRegisters(*code); \
+        int start = frame->base + (frame->env ? 0 : 1 + (int)code->locals.size()); \
+        if ((int)st.size() < start + code->registers) \
+            st.resize(start + code->registers); \
+        ops = &code->regOps[0]; \
+        ip = ops + frame->cp; \
+        r = st.data() + start; \
+        scopes[0] = frame->env ? frame->env->slots.data() : st.data() + frame->base + 1; \
+        scopes[1] = frame->closure->env ? frame->closure->env->slots.data() : 0; \
+        if (jitThreshold && frame->cp == 0 && code->calls >= 0 && ++code->calls >= jitThreshold) \
+            compileNative(code); \
+        if (jitThreshold && code->native) \
+        { \
+            int next = code->native(this, r, scopes, frame->cp); \
+            if (next < 0) \
+                goto called; \
+            ip = ops + next; \
+        } \
+    } while (0)
+#define SL_SAVE_FRAME() (frame->cp = int(ip - ops))
+
+#ifdef __GNUC__
+#define SL_OP_HANDLER(t) &&op_##t,
+    static void* const handlers[] = { SL_OPS(SL_OP_HANDLER) };
+#undef SL_OP_HANDLER
+#define SL_NEXT() do { op = ip++; SL_COUNT_OP(op->type); goto *handlers[op->type]; } while (0)
+#define SL_OP(t) case Code::t: op_##t
+#else
+#define SL_NEXT() goto dispatch
+#define SL_OP(t) case Code::t
+#endif
+
+    SL_LOAD_FRAME();
+
+dispatch:
+    op = ip++;
+    SL_COUNT_OP(op->type);
+    switch (op->type)
+    {
+    SL_OP(NONE):
+    SL_OP(POP):
+    SL_OP(DEFINE_DISCARD):
+    SL_OP(SET_LOCAL_DISCARD):
+    SL_OP(LOOKUP_LOOKUP_LOCAL):
+    SL_OP(LOOKUP_LOCAL_APPLY):
+    SL_OP(PUSH_APPLY):
+    default:
+        assert(!"weird");
+        SL_NEXT();
+
+    SL_OP(RETURN):
+        {
+            Value* v = r[op->a];
+            st.resize(frame->base);
+            c->frames.pop_back();
+            st.push_back(v);
+        }
+        if (c->frames.empty())
+            goto done;
+        SL_LOAD_FRAME();
+        goto dispatch;
+
+    SL_OP(PUSH):
+        r[op->dst] = op->value;
+        SL_NEXT();
+
+    SL_OP(LOOKUP):
+        {
+            Value* v = op->value->getGlobal()->value;
+            if (!v)
+            {
+                SL_SAVE_FRAME();
+                setError(symUndefinedIdentifier, op->value->getGlobal()->sym, c);
+                goto done;
+            }
+            r[op->dst] = v;
+        }
+        SL_NEXT();
+
+    SL_OP(LOOKUP_LOCAL):
+        {
+            Value* v = scopes[Code::localDepth(op->i)][Code::localSlot(op->i)];
+            if (!v)
+            {
+                SL_SAVE_FRAME();
+                setError(symUndefinedIdentifier, op->value, c);
+                goto done;
+            }
+            r[op->dst] = v;
+        }
+        SL_NEXT();
+
+    SL_OP(LOOKUP_BOX):
+        {
+            Value* v = ((Pair*)scopes[Code::localDepth(op->i)][Code::localSlot(op->i)])->car;
+            if (!v)
+            {
+                SL_SAVE_FRAME();
+                setError(symUndefinedIdentifier, op->value, c);
+                goto done;
+            }
+            r[op->dst] = v;
+        }
+        SL_NEXT();
+
+    SL_OP(SET_BOX):
+        {
+            Pair* box = (Pair*)scopes[Code::localDepth(op->i)][Code::localSlot(op->i)];
+            box->car = r[op->a];
+            writeBarrier(box, r[op->a]);
+        }
+        r[op->dst] = nil();
+        SL_NEXT();
+
+    SL_OP(LAMBDA):
+        r[op->dst] = makeFlatClosure(scopes, op->value->getCode());
+        SL_NEXT();
+
+    SL_OP(DEFINE):
+    SL_OP(SET):
+        op->value->getGlobal()->value = r[op->a];
+        writeBarrier(op->value, r[op->a]);
+        r[op->dst] = nil();
+        SL_NEXT();
+
+    SL_OP(SET_LOCAL):
+        {
+            scopes[Code::localDepth(op->i)][Code::localSlot(op->i)] = r[op->a];
+            if (frame->env)
+                writeBarrier(frame->env, r[op->a]);
+        }
+        r[op->dst] = nil();
+        SL_NEXT();
+
+    SL_OP(PRIM_CAR):
+        if (isBuiltin(op->value, s_car) && typeOf(r[op->a]) == Value::PAIR)
+        {
+            r[op->dst] = ((Pair*)r[op->a])->car;
+            SL_NEXT();
+        }
+        goto primitiveCall;
+
+    SL_OP(PRIM_CDR):
+        if (isBuiltin(op->value, s_cdr) && typeOf(r[op->a]) == Value::PAIR)
+        {
+            r[op->dst] = ((Pair*)r[op->a])->cdr;
+            SL_NEXT();
+        }
+        goto primitiveCall;
+
+    SL_OP(PRIM_CONS):
+        if (isBuiltin(op->value, s_cons))
+        {
+            r[op->dst] = makePair(r[op->a], r[op->b]);
+            SL_NEXT();
+        }
+        goto primitiveCall;
+
+    SL_OP(PRIM_EQ):
+        if (isBuiltin(op->value, s_eq))
+        {
+            r[op->dst] = makeBoolean(r[op->a] == r[op->b]);
+            SL_NEXT();
+        }
+        goto primitiveCall;
+
+#define SL_ARITH_OP(t, name, fixnumOp) \
+    SL_OP(t): \
+        { \
+            Value* a = r[op->a]; \
+            Value* b = r[op->b]; \
+            Value* v; \
+            if (isBuiltin(op->value, s_##name) && Value::isFixnum(a) && Value::isFixnum(b) && fixnumOp(a, b, v)) \
+            { \
+                r[op->dst] = v; \
+                SL_NEXT(); \
+            } \
+        } \
+        goto primitiveCall;
+
+#define SL_COMPARE_OP(t, name, o) \
+    SL_OP(t): \
+        { \
+            Value* a = r[op->a]; \
+            Value* b = r[op->b]; \
+            if (isBuiltin(op->value, s_##name) && Value::isFixnum(a) && Value::isFixnum(b)) \
+            { \
+                r[op->dst] = makeBoolean((intptr_t)a o (intptr_t)b); \
+                SL_NEXT(); \
+            } \
+        } \
+        goto primitiveCall;
+
+    SL_ARITH_OP(PRIM_ADD, add, fixnumAdd)
+    SL_ARITH_OP(PRIM_SUB, sub, fixnumSub)
+    SL_COMPARE_OP(PRIM_LT,    lt,    <)
+    SL_COMPARE_OP(PRIM_GT,    gt,    >)
+    SL_COMPARE_OP(PRIM_LE,    le,    <=)
+    SL_COMPARE_OP(PRIM_GE,    ge,    >=)
+    SL_COMPARE_OP(PRIM_EQNUM, eqnum, ==)
+#undef SL_ARITH_OP
+#undef SL_COMPARE_OP
+
+    SL_OP(PRIM_NULL):
+        if (isBuiltin(op->value, s_null))
+        {
+            r[op->dst] = makeBoolean(typeOf(r[op->a]) == Value::NIL);
+            SL_NEXT();
+        }
+        goto primitiveCall;
+
+    SL_OP(PRIM_PAIR):
+        if (isBuiltin(op->value, s_pair))
+        {
+            r[op->dst] = makeBoolean(typeOf(r[op->a]) == Value::PAIR);
+            SL_NEXT();
+        }
+        goto primitiveCall;
+
+    primitiveCall:
+        callee = op->value->getGlobal()->value;
+        args = r + op->a;
+        argc = primitiveArgc(op->type);
+        dst = op->dst;
+        tail = op->i;
+        goto call;
+
+    SL_OP(SKIP_IF_FALSE):
+        if (r[op->a] == f())
+            ip += op->i;
+        SL_NEXT();
+
+    SL_OP(SKIP):
+        ip += op->i;
+        SL_NEXT();
+
+    SL_OP(CONS):
+        r[op->dst] = makePair(r[op->a], r[op->b]);
+        SL_NEXT();
+
+    SL_OP(SPLICING):
+        r[op->dst] = append(*this, r[op->a], r[op->b]);
+        SL_NEXT();
+
+    SL_OP(APPLY):
+    SL_OP(TAIL_APPLY):
+        callee = r[op->a];
+        args = r + op->a + 1;
+        argc = op->i;
+        dst = op->dst;
+        tail = op->type == Code::TAIL_APPLY;
+    call:
+        {
+            // As on the stack machine: the callee and the arguments go to
+            // dst, or for a tail call to where this frame started, and the
+            // stack is cut back after them. APPLY has them there already
+            // unless this frame's locals are on the stack.
+            int top = tail ? frame->base : int(r - st.data()) + dst;
+            SL_SAVE_FRAME();
+            if (args == st.data() + top + 1 && st[top] == callee)
+                st.resize(top + 1 + argc);
+            else
+            {
+                argBuffer.assign(args, args + argc);
+                st.resize(top);
+                st.push_back(callee);
+                st.insert(st.end(), argBuffer.begin(), argBuffer.end());
+            }
+            if (typeOf(callee) == Value::CLOSURE)
+            {
+                Continuation::Frame f2 = applyClosure(st, top, argc);
+                if (hasError())
+                    goto done;
+                if (tail)
+                    c->frames.pop_back();
+                c->frames.push_back(f2);
+            }
+            else
+            {
+                // A frame dropped for a tail call is put back if the
+                // procedure fails, so that the error is reported at the
+                // call. The procedure may collect, so its closure is kept.
+                Handle<Closure> caller(*this, tail ? frame->closure : 0);
+                int callerCp = frame->cp;
+                argBuffer.assign(st.begin() + top + 1, st.end());
+                st.resize(top);
+                if (tail)
+                    c->frames.pop_back();
+                apply(callee, argc, argBuffer.empty() ? 0 : &argBuffer[0]);
+                if (hasError())
+                {
+                    if (caller && error.continuation == c)
+                    {
+                        Continuation::Frame f(0, caller);
+                        f.cp = callerCp;
+                        f.base = st.size();
+                        c->frames.push_back(f);
+                    }
+                    goto done;
+                }
+                if (c->isOld())
+                    heap.remember(c); // the procedure may have collected
+                if (c->frames.empty())
+                    goto done;
+            }
+        }
+    called:
+        // Machine code that made a call comes here too, with the error if
+        // the call failed.
+        if (hasError())
+            goto done;
+        if (collectionDue())
+        {
+            collect();
+            if (c->isOld())
+                heap.remember(c);
+        }
+        SL_LOAD_FRAME();
+        goto dispatch;
+    }
+
+done:
+#undef SL_OP
+#undef SL_NEXT
+#undef SL_COUNT_OP
+#undef SL_SAVE_FRAME
+#undef SL_LOAD_FRAME
+    return;
+}
+
+#ifdef SL_JIT
+// Emits x86-64 machine code. Memory operands are always [base + disp32].
+class Assembler
+{
+public:
+    enum Reg { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+    enum Cond { O = 0x0, E = 0x4, NE = 0x5, L = 0xc, GE = 0xd, LE = 0xe, G = 0xf };
+
+    std::vector<uint8_t> out;
+
+    int  here() const { return out.size(); }
+    void byte(int b)  { out.push_back(uint8_t(b)); }
+    void int32(int v) { for (int i = 0; i < 4; i++) byte(v >> (8 * i)); }
+
+    void movImm(Reg r, const void* v)
+    {
+        rex(1, 0, r);
+        byte(0xb8 + (r & 7));
+        for (int i = 0; i < 8; i++)
+            byte((uint64_t)(uintptr_t)v >> (8 * i));
+    }
+    void movImm32(Reg r, int v)             { rex(0, 0, r); byte(0xb8 + (r & 7)); int32(v); }
+    void load(Reg r, Reg base, int disp)    { rex(1, r, base); byte(0x8b); mem(r, base, disp); }
+    void store(Reg base, int disp, Reg r)   { rex(1, r, base); byte(0x89); mem(r, base, disp); }
+    void loadByte(Reg r, Reg base, int disp) { rex(0, r, base); byte(0x0f); byte(0xb6); mem(r, base, disp); } // movzx r32, byte
+    void mov (Reg dst, Reg src) { binary(0x89, dst, src); }
+    void add (Reg dst, Reg src) { binary(0x01, dst, src); }
+    void sub (Reg dst, Reg src) { binary(0x29, dst, src); }
+    void cmp (Reg dst, Reg src) { binary(0x39, dst, src); }
+    void test(Reg dst, Reg src) { binary(0x85, dst, src); }
+    void cmpImm(Reg r, int v)   { rex(1, 0, r); byte(0x81); byte(0xf8 | (r & 7)); int32(v); }
+    void subImm(Reg r, int v)   { rex(1, 0, r); byte(0x81); byte(0xe8 | (r & 7)); int32(v); }
+    void shlImm(Reg r, int n)   { rex(1, 0, r); byte(0xc1); byte(0xe0 | (r & 7)); byte(n); }
+    void testLow(Reg r, int v)  { assert(r <= RBX); byte(0xf6); byte(0xc0 | r); byte(v); } // of the low byte
+    void setcc(Cond c)          { byte(0x0f); byte(0x90 | c); byte(0xc0); } // al
+    void movzxAl()              { byte(0x0f); byte(0xb6); byte(0xc0); }      // eax from al
+    void push(Reg r)            { rex(0, 0, r); byte(0x50 + (r & 7)); }
+    void pop (Reg r)            { rex(0, 0, r); byte(0x58 + (r & 7)); }
+    void ret()                  { byte(0xc3); }
+    void call(const void* f)    { movImm(RAX, f); byte(0xff); byte(0xd0); }
+
+    // Jumps are emitted with a zero offset and patched once the target is
+    // known.
+    int  jmp()        { byte(0xe9); int32(0); return here() - 4; }
+    int  jcc(Cond c)  { byte(0x0f); byte(0x80 | c); int32(0); return here() - 4; }
+    void patch(int at, int target)
+    {
+        int rel = target - (at + 4);
+        memcpy(&out[at], &rel, 4);
+    }
+
+private:
+    void rex(int w, int reg, int rm)
+    {
+        int r = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+        if (r != 0x40)
+            byte(r);
+    }
+    void mem(int reg, int base, int disp)
+    {
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == RSP)
+            byte(0x24);
+        int32(disp);
+    }
+    void binary(int opcode, Reg dst, Reg src)
+    {
+        rex(1, src, dst);
+        byte(opcode);
+        byte(0xc0 | ((src & 7) << 3) | (dst & 7));
+    }
+};
+
+// Where the fields that machine code reads sit in their objects. Found out
+// from real objects, and the JIT stays off if the layout is not as expected.
+struct JitLayout
+{
+    int  globalValue, pairCar, pairCdr, procedureProc;
+    bool ok;
+
+    JitLayout()
+    {
+        Pair      pair(0, 0);
+        Global    global(0);
+        Procedure procedure(0);
+
+        globalValue   = offset(&global, &global.value);
+        pairCar       = offset(&pair, &pair.car);
+        pairCdr       = offset(&pair, &pair.cdr);
+        procedureProc = offset(&procedure, &procedure.proc);
+
+        ok = *(uint8_t*)&pair == Value::PAIR && *(uint8_t*)&procedure == Value::PROCEDURE;
+    }
+
+    static int offset(const void* object, const void* field) { return int((const char*)field - (const char*)object); }
+};
+
+static const JitLayout& jitLayout()
+{
+    static JitLayout layout;
+    return layout;
+}
+
+// Returns the built-in procedure of a PRIM_ op, or 0 for other ops.
+static Procedure::proctype primitiveProc(int type)
+{
+    switch (type)
+    {
+#define SL_PRIMITIVE_PROC(op, name, n) case Code::op: return s_##name;
+    SL_PRIMITIVES(SL_PRIMITIVE_PROC)
+#undef SL_PRIMITIVE_PROC
+    default: return 0;
+    }
+}
+
+// Machine code lives in its own pages, written and then made executable.
+static void* installNative(const std::vector<uint8_t>& bytes, size_t& size)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size = (bytes.size() + page - 1) / page * page;
+    void* p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return 0;
+    memcpy(p, bytes.data(), bytes.size());
+    if (mprotect(p, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(p, size);
+        return 0;
+    }
+    return p;
+}
+
+// Tells perf where the code came from. Flushed at once, as perf reads the
+// map whenever it likes.
+static void writePerfMap(FILE* fp, const void* p, size_t size, FilePos pos)
+{
+    fprintf(fp, "%lx %lx schemelet:%s:%d\n", (unsigned long)(uintptr_t)p, (unsigned long)size,
+            pos.f ? pos.f->s.c_str() : "?", pos.p);
+    fflush(fp);
+}
+#endif
+
+void Context::setPerfMap(bool on)
+{
+    if (perfMap)
+        fclose(perfMap);
+    perfMap = 0;
+#ifdef SL_JIT
+    if (on)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "/tmp/perf-%d.map", (int)getpid());
+        perfMap = fopen(name, "a");
+    }
+#else
+    (void)on;
+#endif
+}
+
+static void releaseNative(Code* code)
+{
+#ifdef SL_JIT
+    if (code->native)
+        munmap((void*)code->native, code->nativeSize);
+#endif
+    code->native = 0;
+    code->nativeSize = 0;
+    code->calls = 0;
+}
+
+// Does an op for machine code that needs the Context: allocation, write
+// barriers and the full checks of built-ins. Returns false to leave the op
+// to the interpreter.
+bool Context::nativeOp(Context* ctx, const Code::RegOp* op, Value** r, Value** const* scopes)
+{
+    switch (op->type)
+    {
+    case Code::DEFINE:
+    case Code::SET:
+        op->value->getGlobal()->value = r[op->a];
+        ctx->writeBarrier(op->value, r[op->a]);
+        r[op->dst] = ctx->nil();
+        return true;
+
+    case Code::SET_LOCAL:
+        {
+            Env* e = ctx->currentContinuation->frames.back().env;
+            scopes[Code::localDepth(op->i)][Code::localSlot(op->i)] = r[op->a];
+            if (e)
+                ctx->writeBarrier(e, r[op->a]);
+        }
+        r[op->dst] = ctx->nil();
+        return true;
+
+    case Code::SET_BOX:
+        {
+            Pair* box = (Pair*)scopes[Code::localDepth(op->i)][Code::localSlot(op->i)];
+            box->car = r[op->a];
+            ctx->writeBarrier(box, r[op->a]);
+        }
+        r[op->dst] = ctx->nil();
+        return true;
+
+    case Code::LAMBDA:
+        r[op->dst] = ctx->makeFlatClosure(scopes, op->value->getCode());
+        return true;
+
+    case Code::PRIM_CONS:
+        if (!isBuiltin(op->value, s_cons))
+            return false;
+        // fall through
+    case Code::CONS:
+        r[op->dst] = ctx->makePair(r[op->a], r[op->b]);
+        return true;
+
+    case Code::SPLICING:
+        r[op->dst] = append(*ctx, r[op->a], r[op->b]);
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+// Makes an APPLY for machine code if the callee is a procedure, as the
+// interpreter would: the result goes to dst and the registers after it are
+// cleared. Returns 0 to leave the call to the interpreter, 1 if machine code
+// goes on with the next op, and 2 if the interpreter has to finish the call,
+// because it failed, changed the frames or the stack, or a collection is
+// due.
+int Context::nativeApply(Context* ctx, const Code::RegOp* op, Value** r)
+{
+    Value* callee = r[op->a];
+    if (typeOf(callee) != Value::PROCEDURE)
+        return 0;
+
+    Continuation* c = ctx->currentContinuation;
+    std::vector<Value*>& st = c->stack;
+    Continuation::Frame& frame = c->frames.back();
+    const Code* code = frame.closure->code;
+    int frames = c->frames.size();
+    int top = int(r - st.data()) + op->dst;
+    int end = int(r - st.data()) + code->registers;
+
+    frame.cp = int(op - &code->regOps[0]) + 1;
+    ctx->argBuffer.assign(r + op->a + 1, r + op->a + 1 + op->i);
+    st.resize(top);
+    ctx->apply(callee, op->i, ctx->argBuffer.empty() ? 0 : &ctx->argBuffer[0]);
+    if (c->isOld())
+        ctx->heap.remember(c); // the procedure may have collected
+    if (ctx->hasError() || (int)c->frames.size() != frames || (int)st.size() != top + 1 ||
+        st.data() + top - op->dst != r)
+        return 2;
+
+    st.resize(end);
+    return ctx->collectionDue() ? 2 : 1;
+}
+
+// Compiles the register ops of code to a function that runs them from the op
+// it is given until one that it leaves to the interpreter: calls of closures
+// and continuations, tail calls, returns, errors and built-ins on arguments
+// that need the full procedure. It returns the index of that op, so the
+// interpreter goes on with it; these all end in a frame change, which enters
+// the machine code again. Calls of procedures are made by nativeApply()
+// without leaving the machine code, unless the interpreter has to finish
+// them. Registers stay in the frame; only the last one written is kept in RAX
+// for the ops after it.
+void Context::compileNative(Code* code)
+{
+    code->calls = -1; // compiled, or not worth trying again
+#ifdef SL_JIT
+    const JitLayout& layout = jitLayout();
+    if (!layout.ok)
+        return;
+
+    typedef Assembler A;
+    const std::vector<Code::RegOp>& ops = code->regOps;
+    int n = ops.size();
+    A a;
+
+    // Machine code may be entered at the start and after calls, and skips
+    // land on ops; no register is known to be in RAX there.
+    std::vector<bool> entry(n + 1);
+    entry[0] = true;
+    for (int k = 0; k < n; k++)
+    {
+        Code::OpType t = ops[k].type;
+        if (t == Code::SKIP || t == Code::SKIP_IF_FALSE)
+            entry[k + 1 + ops[k].i] = true;
+        if (t == Code::APPLY || t == Code::TAIL_APPLY || t == Code::RETURN || primitiveArgc(t) >= 0)
+            entry[k + 1] = true;
+    }
+
+    std::vector<int> label(n);
+    std::vector<std::pair<int, int> > skips; // jump to patch, target op
+    std::vector<std::pair<int, int> > bails; // jump to patch, op to hand back
+    int cached = -1;                         // the register in RAX
+
+    // Called with the Context, the registers, the scopes and the op to
+    // start at. R12 holds the registers, R13 the scopes and R14 the Context.
+    a.push(A::R12);
+    a.push(A::R13);
+    a.push(A::R14);
+    a.mov(A::R14, A::RDI);
+    a.mov(A::R12, A::RSI);
+    a.mov(A::R13, A::RDX);
+    a.byte(0x89); a.byte(0xc9);                          // mov ecx, ecx
+    a.byte(0x48); a.byte(0x8d); a.byte(0x05);            // lea rax, [rip + table]
+    int table = a.here();
+    a.int32(0);
+    a.byte(0x48); a.byte(0x63); a.byte(0x14); a.byte(0x88); // movsxd rdx, [rax + rcx*4]
+    a.add(A::RAX, A::RDX);
+    a.byte(0xff); a.byte(0xe0);                          // jmp rax
+
+    // Reads register i into reg, from RAX if it is there.
+#define SL_LOAD(reg, i) \
+    do \
+    { \
+        if (cached == (i)) \
+        { \
+            if ((reg) != A::RAX) \
+                a.mov(reg, A::RAX); \
+        } \
+        else \
+        { \
+            a.load(reg, A::R12, (i) * 8); \
+            if ((reg) == A::RAX) \
+                cached = (i); \
+        } \
+    } while (0)
+#define SL_STORE_RAX(i) (a.store(A::R12, (i) * 8, A::RAX), cached = (i))
+#define SL_BAIL(cond)   bails.push_back(std::make_pair(a.jcc(cond), k))
+
+    for (int k = 0; k < n; k++)
+    {
+        const Code::RegOp& op = ops[k];
+        label[k] = a.here();
+        if (entry[k])
+            cached = -1;
+
+        // PRIM_ ops check that the cell holds the built-in, with RCX and
+        // RDX only. PRIM_CONS is checked by nativeOp(), which allocates.
+        Procedure::proctype builtin = op.type == Code::PRIM_CONS ? 0 : primitiveProc(op.type);
+        if (builtin)
+        {
+            a.movImm(A::RDX, op.value);
+            a.load(A::RDX, A::RDX, layout.globalValue);
+            a.test(A::RDX, A::RDX);
+            SL_BAIL(A::E);
+            a.testLow(A::RDX, 7);
+            SL_BAIL(A::NE);
+            a.loadByte(A::RCX, A::RDX, 0);
+            a.cmpImm(A::RCX, Value::PROCEDURE);
+            SL_BAIL(A::NE);
+            a.load(A::RCX, A::RDX, layout.procedureProc);
+            a.movImm(A::RDX, (const void*)builtin);
+            a.cmp(A::RCX, A::RDX);
+            SL_BAIL(A::NE);
+        }
+
+        switch (op.type)
+        {
+        case Code::PUSH:
+            a.movImm(A::RAX, op.value);
+            SL_STORE_RAX(op.dst);
+            break;
+
+        case Code::LOOKUP:
+            a.movImm(A::RAX, op.value);
+            a.load(A::RAX, A::RAX, layout.globalValue);
+            a.test(A::RAX, A::RAX);
+            SL_BAIL(A::E);
+            SL_STORE_RAX(op.dst);
+            break;
+
+        case Code::LOOKUP_LOCAL:
+        case Code::LOOKUP_BOX:
+            a.load(A::RAX, A::R13, Code::localDepth(op.i) * 8);
+            a.load(A::RAX, A::RAX, Code::localSlot(op.i) * 8);
+            if (op.type == Code::LOOKUP_BOX)
+                a.load(A::RAX, A::RAX, layout.pairCar);
+            a.test(A::RAX, A::RAX);
+            SL_BAIL(A::E);
+            SL_STORE_RAX(op.dst);
+            break;
+
+        case Code::SKIP:
+            skips.push_back(std::make_pair(a.jmp(), k + 1 + op.i));
+            break;
+
+        case Code::SKIP_IF_FALSE:
+            SL_LOAD(A::RAX, op.a);
+            a.cmpImm(A::RAX, Value::FALSE_BITS);
+            skips.push_back(std::make_pair(a.jcc(A::E), k + 1 + op.i));
+            break;
+
+        case Code::PRIM_CAR:
+        case Code::PRIM_CDR:
+            SL_LOAD(A::RAX, op.a);
+            a.testLow(A::RAX, 7);
+            SL_BAIL(A::NE);
+            a.loadByte(A::RCX, A::RAX, 0);
+            a.cmpImm(A::RCX, Value::PAIR);
+            SL_BAIL(A::NE);
+            a.load(A::RAX, A::RAX, op.type == Code::PRIM_CAR ? layout.pairCar : layout.pairCdr);
+            SL_STORE_RAX(op.dst);
+            break;
+
+        case Code::PRIM_ADD:
+        case Code::PRIM_SUB:
+            // As fixnumAdd() and fixnumSub(): a plus or minus b without its
+            // tag, failing on overflow.
+            SL_LOAD(A::RCX, op.b);
+            SL_LOAD(A::RAX, op.a);
+            a.testLow(A::RAX, 1);
+            SL_BAIL(A::E);
+            a.testLow(A::RCX, 1);
+            SL_BAIL(A::E);
+            a.subImm(A::RCX, 1);
+            if (op.type == Code::PRIM_ADD)
+                a.add(A::RAX, A::RCX);
+            else
+                a.sub(A::RAX, A::RCX);
+            cached = -1;
+            SL_BAIL(A::O);
+            SL_STORE_RAX(op.dst);
+            break;
+
+        case Code::PRIM_LT:
+        case Code::PRIM_GT:
+        case Code::PRIM_LE:
+        case Code::PRIM_GE:
+        case Code::PRIM_EQNUM:
+        case Code::PRIM_EQ:
+            {
+                A::Cond c = op.type == Code::PRIM_LT ? A::L : op.type == Code::PRIM_GT ? A::G :
+                            op.type == Code::PRIM_LE ? A::LE : op.type == Code::PRIM_GE ? A::GE : A::E;
+                SL_LOAD(A::RCX, op.b);
+                SL_LOAD(A::RAX, op.a);
+                if (op.type != Code::PRIM_EQ)
+                {
+                    a.testLow(A::RAX, 1);
+                    SL_BAIL(A::E);
+                    a.testLow(A::RCX, 1);
+                    SL_BAIL(A::E);
+                }
+                a.cmp(A::RAX, A::RCX);
+                a.setcc(c);
+            }
+            goto boolean;
+
+        case Code::PRIM_NULL:
+            SL_LOAD(A::RAX, op.a);
+            a.cmpImm(A::RAX, Value::NIL_BITS);
+            a.setcc(A::E);
+            goto boolean;
+
+        case Code::PRIM_PAIR:
+            {
+                SL_LOAD(A::RAX, op.a);
+                a.movImm32(A::RCX, 0);
+                a.testLow(A::RAX, 7);
+                int notHeap = a.jcc(A::NE);
+                a.loadByte(A::RDX, A::RAX, 0);
+                a.cmpImm(A::RDX, Value::PAIR);
+                a.byte(0x0f); a.byte(0x94); a.byte(0xc1); // sete cl
+                a.patch(notHeap, a.here());
+                a.mov(A::RAX, A::RCX);
+            }
+            goto boolean;
+
+        boolean:
+            // #t and #f are 8 apart.
+            a.movzxAl();
+            a.shlImm(A::RAX, 3);
+            a.movImm(A::RCX, (const void*)Value::FALSE_BITS);
+            a.sub(A::RCX, A::RAX);
+            a.mov(A::RAX, A::RCX);
+            SL_STORE_RAX(op.dst);
+            break;
+
+        case Code::DEFINE:
+        case Code::SET:
+        case Code::SET_LOCAL:
+        case Code::SET_BOX:
+        case Code::LAMBDA:
+        case Code::CONS:
+        case Code::SPLICING:
+        case Code::PRIM_CONS:
+            a.mov(A::RDI, A::R14);
+            a.movImm(A::RSI, &op);
+            a.mov(A::RDX, A::R12);
+            a.mov(A::RCX, A::R13);
+            a.call((const void*)&Context::nativeOp);
+            cached = -1;
+            a.testLow(A::RAX, 0xff);
+            SL_BAIL(A::E);
+            break;
+
+        case Code::APPLY:
+            {
+                a.mov(A::RDI, A::R14);
+                a.movImm(A::RSI, &op);
+                a.mov(A::RDX, A::R12);
+                a.call((const void*)&Context::nativeApply);
+                cached = -1;
+                a.testLow(A::RAX, 0xff);
+                SL_BAIL(A::E);
+                a.testLow(A::RAX, 2);
+                int made = a.jcc(A::E);
+                a.movImm32(A::RAX, -1);
+                bails.push_back(std::make_pair(a.jmp(), -1));
+                a.patch(made, a.here());
+            }
+            break;
+
+        default:
+            // Calls, returns and anything else go to the interpreter.
+            a.movImm32(A::RAX, k);
+            bails.push_back(std::make_pair(a.jmp(), -1));
+            cached = -1;
+            break;
+        }
+    }
+#undef SL_LOAD
+#undef SL_STORE_RAX
+#undef SL_BAIL
+
+    // Ops that are not entries go to the interpreter if they are entered
+    // anyway; RCX still holds the op index then.
+    int anyOp = a.here();
+    a.mov(A::RAX, A::RCX);
+    int exitFromAny = a.jmp();
+
+    for (int i = 0; i < (int)bails.size(); i++)
+    {
+        if (bails[i].second < 0)
+            continue;
+        a.patch(bails[i].first, a.here());
+        a.movImm32(A::RAX, bails[i].second);
+        bails[i].first = a.jmp();
+    }
+
+    int exit = a.here();
+    a.pop(A::R14);
+    a.pop(A::R13);
+    a.pop(A::R12);
+    a.ret();
+
+    a.patch(exitFromAny, exit);
+    for (int i = 0; i < (int)bails.size(); i++)
+        a.patch(bails[i].first, exit);
+    for (int i = 0; i < (int)skips.size(); i++)
+        a.patch(skips[i].first, label[skips[i].second]);
+
+    while (a.here() % 4)
+        a.byte(0xcc);
+    a.patch(table, a.here());
+    int base = a.here();
+    for (int k = 0; k < n; k++)
+        a.int32((entry[k] ? label[k] : anyOp) - base);
+
+    size_t size;
+    void* p = installNative(a.out, size);
+    if (!p)
+        return;
+    code->native = (Code::NativeCode)p;
+    code->nativeSize = size;
+    if (perfMap)
+        writePerfMap(perfMap, p, a.out.size(), findPos(*code, code->positions, 0));
+#endif
+}
+
+// The op that raised the error is the one before where the top frame of the
+// error's continuation stopped.
+FilePos Context::getErrorPos() const
+{
+    Continuation* c = error.continuation;
+    if (!c || c->frames.empty())
+        return FilePos();
+
+    const Continuation::Frame& frame = c->frames.back();
+    const Code& code = *frame.closure->code;
+    return findPos(code, backend == REGISTER_MACHINE ? code.regPositions : code.positions, frame.cp - 1);
+}
+
+// A call with the wrong number of arguments fails with those after the
+// first n, or nil if there were too few.
+static Value* extraArguments(Context& ctx, int n, int argc, Value* const* argv)
+{
+    Value* extra = ctx.nil();
+    for (int i = argc - 1; i >= n; i--)
+        extra = ctx.makePair(argv[i], extra);
+    return extra;
+}
+
+void Context::apply(Value* callee, int argc, Value** argv)
+{
+    assert(currentContinuation);
+    Continuation* c = currentContinuation;
+
+    if (typeOf(callee) == Value::PROCEDURE)
+    {
+        Value* v = callee->getProcedure()->proc(*this, argc, argv);
+        assert((v == 0) == hasError());
+
+        if (hasError())
+        {
+            error.continuation = currentContinuation;
+            return;
+        }
+
+        if (v != omitted())
+            c->stack.push_back(v);
+    }
+    else if (typeOf(callee) == Value::CLOSURE)
+    {
+        int base = c->stack.size();
+        c->stack.push_back(callee);
+        c->stack.insert(c->stack.end(), argv, argv + argc);
+        Continuation::Frame f = applyClosure(c->stack, base, argc);
+        if (!hasError())
+            c->frames.push_back(f);
+    }
+    else if (typeOf(callee) == Value::CONTINUATION)
+    {
+        if (argc != 1)
+        {
+            setError(symBadArgumentCount, extraArguments(*this, 1, argc, argv), c);
+            return;
+        }
+        Value* v = argv[0];
+        *c = *callee->getContinuation();
+        c->stack.push_back(v);
+    }
+    else
+    {
+        printValue(*this, callee, 8);
+        assert(0);
+    }
+}
+
+// Binds the arguments of a call of the closure at st[base], which are after
+// it on the stack. The stack is left as the frame has it: cut back to base
+// if its locals go to an Env, or else holding the callee and the locals,
+// the formals where the arguments were.
+Continuation::Frame Context::applyClosure(std::vector<Value*>& st, int base, int argc)
+{
+    Closure* c = st[base]->getClosure();
+    const Code& code = *c->code;
+
+    int n = code.formals.size();
+    if (argc < n || (argc > n && !code.rest))
+    {
+        setError(symBadArgumentCount, extraArguments(*this, n, argc, st.data() + base + 1), currentContinuation);
+        st.resize(base);
+        return Continuation::Frame(0, 0);
+    }
+
+    Value* rest = nil();
+    if (code.rest)
+        for (int i = argc - 1; i >= n; i--)
+            rest = makePair(st[base + 1 + i], rest);
+
+    Env* env = 0;
+    Value** slots;
+    if (code.onStack)
+    {
+        st.resize(base + 1 + code.locals.size());
+        std::fill(st.begin() + base + 1 + n, st.end(), (Value*)0);
+        slots = &st[base + 1];
+    }
+    else
+    {
+        env = makeEnv(c->env, code.locals.size());
+        slots = env->slots.data();
+        std::copy(st.begin() + base + 1, st.begin() + base + 1 + n, slots);
+        st.resize(base);
+    }
+
+    if (code.rest)
+        slots[n] = rest;
+
+    for (int i = 0; i < (int)code.boxes.size(); i++)
+    {
+        Value*& slot = slots[code.boxes[i]];
+        slot = makePair(slot, nil());
+    }
+
+    Continuation::Frame f(env, c);
+    f.base = base;
+    return f;
+}
+
+// Copies what code captures from the frame with scopes. Code that captures
+// nothing keeps nothing alive.
+Closure* Context::makeFlatClosure(Value** const* scopes, Code* code)
+{
+    int n = code->captureFrom.size();
+    Env* captured = n ? makeEnv(0, n) : 0;
+    for (int k = 0; k < n; k++)
+    {
+        int from = code->captureFrom[k];
+        captured->slots[k] = scopes[Code::localDepth(from)][Code::localSlot(from)];
+    }
+    return makeClosure(captured, code);
+}
+
+//
+// Execute and eval.
+//
+
+Value* Context::annotate(Value* v, const std::map<Value*, FilePos>& pos)
+{
+    Value* pv;
+    if (pos.find(v) == pos.end())
+        pv = nil();
+    else
+        pv = makePair(pos.find(v)->second.f, makeInteger(pos.find(v)->second.p));
+
+    if (typeOf(v) == Value::PAIR)
+        return makePair(makePair(annotate(v->getPair()->car, pos), annotate(v->getPair()->cdr, pos)), pv);
+    else
+        return makePair(v, pv);
+}
+
+Value* Context::unannotate(Value* v, std::map<Value*, FilePos>& pos)
+{
+    if (typeOf(v) != Value::PAIR)
+    {
+        setError(sym("unannotate-failed"), v, 0);
+        return 0;
+    }
+
+    Pair* p = v->getPair();
+    FilePos fp;
+    if (typeOf(p->cdr) == Value::PAIR)
+    {
+        Pair* p2 = p->cdr->getPair();
+        if (typeOf(p2->car) == Value::SYMBOL)
+            fp.f = p2->car->getSymbol();
+        if (typeOf(p2->cdr) == Value::NUMBER)
+            fp.p = int(fixnumValue(p2->cdr));
+    }
+
+    Value* ret;
+    if (typeOf(p->car) == Value::PAIR)
+    {
+        Pair* p2 = p->car->getPair();
+        ret = makePair(unannotate(p2->car, pos), unannotate(p2->cdr, pos));
+    }
+    else
+        ret = p->car;
+
+    pos[ret] = fp;
+    return ret;
+}
+
+Value* Context::macroExpand(Value* v, const std::map<Value*, FilePos>& pos, std::map<Value*, FilePos>& pos2)
+{
+    Value* e = topEnv->findSymbol(symMacroExpander);
+    if (!e)
+    {
+        pos2 = pos;
+        return v;
+    }
+    if (typeOf(e) != Value::CLOSURE)
+    {
+        setError(sym("bad-macro-expander"), e, 0);
+        return 0;
+    }
+
+    // Collections run inside run(), so what is left to expand and what has
+    // been expanded need handles.
+    Handle<Value> rest(*this, v);
+    Handle<Value> res(*this, nil());
+
+    while (typeOf(rest) == Value::PAIR)
+    {
+        Continuation* c = makeContinuation();
+        c->stack.push_back(e);
+        c->stack.push_back(annotate(rest->getPair()->car, pos));
+        Continuation::Frame f = applyClosure(c->stack, 0, 1);
+        if (hasError())
+            return 0;
+
+        rest = rest->getPair()->cdr;
+
+        c->frames.push_back(f);
+
+        run(c);
+        if (hasError())
+            return 0;
+
+        assert(c->stack.size() == 1);
+
+        res = makePair(unannotate(c->stack.back(), pos2), res);
+    }
+
+    // The spine may have been promoted by a collection during expansion.
+    v = reverse(res, nil());
+    for (Value* p = v; typeOf(p) == Value::PAIR; p = p->getPair()->cdr)
+        writeBarrier(p, p->getPair()->cdr);
+    return v;
+}
+
+Value* Context::execute(const char* s, Symbol* file)
+{
+    assert(!hasError());
+
+    std::map<Value*, FilePos> pos2;
+    Value* sl = parseSExpList(s, file, &pos2);
+    if (!sl)
+        return 0;
+
+    std::map<Value*, FilePos> pos;
+    sl = macroExpand(sl, pos2, pos);
+    if (!sl)
+        return 0;
+
+    Code* code = compile(sl, pos);
+
+    Closure* closure = makeClosure(topEnv, code);
+
+    Continuation* c = makeContinuation();
+    c->frames.push_back(Continuation::Frame(topEnv, closure));
+
+    run(c);
+    if (hasError())
+        return 0;
+
+    assert(c->stack.size() == 1);
+    return (Value*)c->stack.back();
+}
+
+//
+// Garbage collection.
+//
+
+//
+// Type dispatch.
+//
+
+static const TypeDescriptor* userTypes[256 - Value::FIRST_USER_TYPE];
+
+void sl::registerType(Value::Type type, const TypeDescriptor* descriptor)
+{
+    assert(type >= Value::FIRST_USER_TYPE && type < 0xfe); // the rest is reserved for the heap
+    userTypes[type - Value::FIRST_USER_TYPE] = descriptor;
+}
+
+const TypeDescriptor* Value::descriptor()
+{
+    if (heapType() == PORT)
+        return ((Port*)this)->cls;
+    assert(heapType() >= FIRST_USER_TYPE && userTypes[heapType() - FIRST_USER_TYPE]);
+    return userTypes[heapType() - FIRST_USER_TYPE];
+}
+
+void Value::markChildren()
+{
+    switch (heapType())
+    {
+    case PAIR:         ((Pair*)this)->markChildren(); break;
+    case VECTOR:       ((Vector*)this)->markChildren(); break;
+    case CODE:         ((Code*)this)->markChildren(); break;
+    case CLOSURE:      ((Closure*)this)->markChildren(); break;
+    case CONTINUATION: ((Continuation*)this)->markChildren(); break;
+    case ENV:          ((Env*)this)->markChildren(); break;
+    case GLOBAL:       ((Global*)this)->markChildren(); break;
+    case SYMBOL:
+    case STRING:
+    case PROCEDURE:
+    case FLONUM:
+    case BIGNUM:
+        break;
+    default:
+        if (void (*m)(Value*) = descriptor()->markChildren)
+            m(this);
+        break;
+    }
+}
+
+thread_local std::vector<Value*> Value::markStack;
+
+bool Value::traceMarks(int& budget)
+{
+    while (!markStack.empty())
+    {
+        if (budget <= 0)
+            return false;
+
+        Value* v = markStack.back();
+        markStack.pop_back();
+
+        // Follow cdr-chains in place, so a long list takes one stack slot
+        // instead of one per pair.
+        while (!v->hasMark())
+        {
+            budget--;
+            v->setMark();
+            if (v->heapType() != PAIR)
+            {
+                v->markChildren();
+                break;
+            }
+            Pair* p = (Pair*)v;
+            mark(p->car);
+            v = p->cdr;
+            if (!v || !isHeap(v))
+                break;
+        }
+    }
+    return true;
+}
+
+namespace
+{
+    // The shared end of a marking thread's work. The owner moves surplus
+    // values here from its private mark stack; idle threads steal half.
+    struct MarkDeque
+    {
+        MarkDeque() : size(0) {}
+        std::mutex         lock;
+        std::deque<Value*> values;
+        std::atomic<int>   size;
+    };
+
+    struct ParallelMark
+    {
+        ParallelMark(int n) : threads(n), deques(n), idle(0) {}
+
+        // Moves up to half of some deque, its own first, onto the stack.
+        bool steal(int self, std::vector<Value*>& stack)
+        {
+            for (int k = 0; k < threads; k++)
+            {
+                MarkDeque& d = deques[(self + k) % threads];
+                if (d.size.load() == 0)
+                    continue;
+                std::lock_guard<std::mutex> guard(d.lock);
+                int n = (d.values.size() + 1) / 2;
+                if (n == 0)
+                    continue;
+                stack.insert(stack.end(), d.values.begin(), d.values.begin() + n);
+                d.values.erase(d.values.begin(), d.values.begin() + n);
+                d.size.store(d.values.size());
+                return true;
+            }
+            return false;
+        }
+
+        void share(int self, std::vector<Value*>& stack)
+        {
+            // The bottom of the stack holds the oldest values, which tend to
+            // have the most left to mark below them.
+            MarkDeque& d = deques[self];
+            std::lock_guard<std::mutex> guard(d.lock);
+            int n = stack.size() / 2;
+            d.values.insert(d.values.end(), stack.begin(), stack.begin() + n);
+            stack.erase(stack.begin(), stack.begin() + n);
+            d.size.store(d.values.size());
+        }
+
+        bool anyWork()
+        {
+            for (int i = 0; i < threads; i++)
+                if (deques[i].size.load() != 0)
+                    return true;
+            return false;
+        }
+
+        // Runs on every marking thread. A thread goes idle only after it
+        // found every deque empty, and only busy threads fill deques, so
+        // marking is over once all threads are idle.
+        void work(int self, std::vector<Value*>& stack);
+
+        int                    threads;
+        std::vector<MarkDeque> deques;
+        std::atomic<int>       idle;
+    };
+}
+
+void ParallelMark::work(int self, std::vector<Value*>& stack)
+{
+    int popped = 0;
+    for (;;)
+    {
+        while (!stack.empty())
+        {
+            Value* v = stack.back();
+            stack.pop_back();
+
+            while (v->tryMark())
+            {
+                if (v->heapType() != Value::PAIR)
+                {
+                    v->markChildren();
+                    break;
+                }
+                Pair* p = (Pair*)v;
+                Value::mark(p->car);
+                v = p->cdr;
+                if (!v || !Value::isHeap(v))
+                    break;
+            }
+
+            if (++popped % 64 == 0 && stack.size() > 32 && deques[self].size.load() == 0)
+                share(self, stack);
+        }
+
+        if (steal(self, stack))
+            continue;
+
+        idle++;
+        for (;;)
+        {
+            if (anyWork())
+            {
+                idle--;
+                break;
+            }
+            if (idle.load() == threads)
+                return;
+            std::this_thread::yield();
+        }
+    }
+}
+
+void Value::traceMarksParallel(int threads)
+{
+    ParallelMark pm(threads);
+
+    // The queued roots are dealt out to the deques to get every thread going.
+    for (int i = 0; i < (int)markStack.size(); i++)
+        pm.deques[i % threads].values.push_back(markStack[i]);
+    for (int i = 0; i < threads; i++)
+        pm.deques[i].size.store(pm.deques[i].values.size());
+    markStack.clear();
+
+    std::vector<std::thread> helpers;
+    for (int i = 1; i < threads; i++)
+        helpers.push_back(std::thread([&pm, i]() { pm.work(i, markStack); }));
+    pm.work(0, markStack);
+    for (int i = 0; i < (int)helpers.size(); i++)
+        helpers[i].join();
+}
+
+void Value::finalize(Value* v)
+{
+    switch (v->heapType())
+    {
+    case SYMBOL:       finalizeAs<Symbol>(v); break;
+    case STRING:       finalizeAs<String>(v); break;
+    case VECTOR:       finalizeAs<Vector>(v); break;
+    case CODE:         releaseNative((Code*)v); finalizeAs<Code>(v); break;
+    case CONTINUATION: finalizeAs<Continuation>(v); break;
+    case ENV:          finalizeAs<Env>(v); break;
+    case BIGNUM:       finalizeAs<Bignum>(v); break;
+    case PAIR:
+    case CLOSURE:
+    case PROCEDURE:
+    case GLOBAL:
+    case FLONUM:
         break;
+    default:
+        if (void (*f)(Value*) = v->descriptor()->finalize)
+            f(v);
+        break;
+    }
+}
 
-    case Code::SKIP:
-        f.cp += op.i;
+template<typename T>
+static void moveAs(Value* from, void* to)
+{
+    new (to) T(std::move(*(T*)from));
+    ((T*)from)->~T();
+}
+
+// Moves the concrete object; only the core types can be moved.
+static void relocate(Value* from, void* to)
+{
+    switch (from->heapType())
+    {
+    case Value::PAIR:         moveAs<Pair>(from, to); break;
+    case Value::SYMBOL:       moveAs<Symbol>(from, to); break;
+    case Value::STRING:       moveAs<String>(from, to); break;
+    case Value::VECTOR:       moveAs<Vector>(from, to); break;
+    case Value::CODE:         moveAs<Code>(from, to); break;
+    case Value::CLOSURE:      moveAs<Closure>(from, to); break;
+    case Value::PROCEDURE:    moveAs<Procedure>(from, to); break;
+    case Value::CONTINUATION: moveAs<Continuation>(from, to); break;
+    case Value::ENV:          moveAs<Env>(from, to); break;
+    case Value::GLOBAL:       moveAs<Global>(from, to); break;
+    case Value::FLONUM:       moveAs<Flonum>(from, to); break;
+    case Value::BIGNUM:       moveAs<Bignum>(from, to); break;
+    default:                  assert(!"not movable"); break;
+    }
+}
+
+static bool isMovable(Value* v)
+{
+    return v->heapType() != Value::PORT && v->heapType() < Value::FIRST_USER_TYPE;
+}
+
+size_t Value::size(Value* v)
+{
+    switch (v->heapType())
+    {
+    case PAIR:         return sizeof(Pair);
+    case SYMBOL:       return sizeof(Symbol);
+    case STRING:       return sizeof(String);
+    case VECTOR:       return sizeof(Vector);
+    case CODE:         return sizeof(Code);
+    case CLOSURE:      return sizeof(Closure);
+    case PROCEDURE:    return sizeof(Procedure);
+    case CONTINUATION: return sizeof(Continuation);
+    case ENV:          return sizeof(Env);
+    case GLOBAL:       return sizeof(Global);
+    case FLONUM:       return sizeof(Flonum);
+    case BIGNUM:       return sizeof(Bignum);
+    default:           return v->descriptor()->size;
+    }
+}
+
+//
+// Heap.
+//
+
+Heap::Heap() : clearPool(0), clearPage(0), sweepPool(-1), spare(0), pageCount(0), live(0), liveBytes(0), allocated(0)
+{
+}
+
+Heap::~Heap()
+{
+    assert(live == 0);
+    for (int i = 0; i < (int)pools.size(); i++)
+        while (Page* page = pools[i].pages)
+        {
+            pools[i].pages = page->next;
+            freePage(page);
+        }
+    for (int i = 0; i < (int)chunks.size(); i++)
+        free(chunks[i]);
+}
+
+int Heap::nextPoolIndex()
+{
+    static int count = 0;
+    return count++;
+}
+
+void Heap::createPool(int index, size_t size)
+{
+    if (index >= (int)pools.size())
+        pools.resize(index + 1);
+    size = std::max(size, sizeof(FreeCell));
+    pools[index].cellSize = (size + SIZE_CLASS - 1) & ~(size_t)(SIZE_CLASS - 1);
+}
+
+Heap::Page* Heap::newPage(int index)
+{
+    int cellSize = pools[index].cellSize;
+    int header = (sizeof(Page) + SIZE_CLASS - 1) & ~(SIZE_CLASS - 1);
+    int size = PAGE_SIZE;
+    Page* page;
+    if (header + cellSize > size)
+    {
+        // Large cells get a page of their own, straight from malloc.
+        size = (header + cellSize + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        page = (Page*)aligned_alloc(PAGE_SIZE, size);
+        if (!page)
+            throw std::bad_alloc();
+    }
+    else
+    {
+        // Ordinary pages come from chunks, so malloc sees a few large
+        // requests rather than one aligned request per page.
+        if (!spare)
+        {
+            char* chunk = (char*)aligned_alloc(CHUNK_PAGES * PAGE_SIZE, CHUNK_PAGES * PAGE_SIZE);
+            if (!chunk)
+                throw std::bad_alloc();
+            chunks.push_back(chunk);
+            for (int i = CHUNK_PAGES - 1; i >= 0; i--)
+            {
+                Page* p = (Page*)(chunk + i * PAGE_SIZE);
+                p->next = spare;
+                spare = p;
+            }
+        }
+        page = spare;
+        spare = page->next;
+    }
+    page->next = 0;
+    page->size = size;
+    page->pool = index;
+    page->bump = page->cells();
+    page->end  = (char*)page + size;
+    pageCount++;
+    return page;
+}
+
+void Heap::freePage(Page* page)
+{
+    pageCount--;
+    if (page->size == PAGE_SIZE)
+    {
+        page->next = spare;
+        spare = page;
+    }
+    else
+        free(page);
+}
+
+void* Heap::allocateSlow(int index)
+{
+    Pool& pool = pools[index];
+    Page* page = newPage(index);
+    page->next = pool.pages;
+    pool.pages = page;
+    pool.current = page;
+
+    void* v = page->bump;
+    page->bump += pool.cellSize;
+    return v;
+}
+
+void Heap::startClear()
+{
+    clearPool = 0;
+    clearPage = pools.empty() ? 0 : pools[0].pages;
+}
+
+bool Heap::clearSome(int& budget)
+{
+    // Pages allocated meanwhile are pushed in front of the cursor; their
+    // values were never marked.
+    while (clearPool < (int)pools.size())
+    {
+        if (!clearPage)
+        {
+            if (++clearPool < (int)pools.size())
+                clearPage = pools[clearPool].pages;
+            continue;
+        }
+        if (budget <= 0)
+            return false;
+
+        int cellSize = pools[clearPool].cellSize;
+        for (char* p = clearPage->cells(); p < clearPage->bump; p += cellSize)
+        {
+            Value* v = (Value*)p;
+            if ((int)v->heapType() == FREE)
+                continue;
+            v->clearMark();
+        }
+        budget -= (clearPage->bump - clearPage->cells()) / cellSize;
+        clearPage = clearPage->next;
+    }
+    return true;
+}
+
+void Heap::startSweep()
+{
+    // Marking is over, so the remembered set is not needed any more, and
+    // some of its values may be about to be freed.
+    for (int i = 0; i < (int)remembered.size(); i++)
+        remembered[i]->header &= ~Value::REMEMBERED_BIT;
+    remembered.clear();
+
+    // Free cells are threaded anew as their pages are swept.
+    for (int i = 0; i < (int)pools.size(); i++)
+    {
+        pools[i].unswept = pools[i].pages;
+        pools[i].pages = 0;
+        pools[i].freeList = 0;
+    }
+    sweepPool = 0;
+}
+
+bool Heap::sweepSome(int& budget)
+{
+    assert(isSweeping());
+    while (sweepPool < (int)pools.size())
+    {
+        Pool& pool = pools[sweepPool];
+        Page* page = pool.unswept;
+        if (!page)
+        {
+            sweepPool++;
+            continue;
+        }
+        if (budget <= 0)
+            return false;
+        pool.unswept = page->next;
+
+        FreeCell* freeList = pool.freeList;
+        int used = 0;
+        for (char* p = page->cells(); p < page->bump; p += pool.cellSize)
+        {
+            Value* v = (Value*)p;
+            if ((int)v->heapType() != FREE)
+            {
+                if (v->hasMark())
+                {
+                    used++;
+                    continue;
+                }
+                Value::finalize(v);
+                live--;
+                liveBytes -= pool.cellSize;
+            }
+            FreeCell* c = (FreeCell*)p;
+            v->header = FREE;
+            c->next = freeList;
+            freeList = c;
+        }
+        budget -= (page->bump - page->cells()) / pool.cellSize;
+
+        if (used == 0)
+        {
+            // Nothing survived; hand the page back instead of threading
+            // its cells onto the free list.
+            if (pool.current == page)
+                pool.current = 0;
+            freePage(page);
+            continue;
+        }
+        pool.freeList = freeList;
+        page->next = pool.pages;
+        pool.pages = page;
+    }
+
+    // Everything that survived, and everything allocated meanwhile, is old
+    // now.
+    young.clear();
+    sweepPool = -1;
+    return true;
+}
+
+void* Heap::allocateIn(int index)
+{
+    Pool& pool = pools[index];
+    if (!pool.current || pool.current->bump + pool.cellSize > pool.current->end)
+    {
+        Page* page = newPage(index);
+        page->next = pool.pages;
+        pool.pages = page;
+        pool.current = page;
+    }
+    void* v = pool.current->bump;
+    pool.current->bump += pool.cellSize;
+    return v;
+}
+
+// Queues the references held by v. The slots are popped last in first out,
+// so a pair's cdr is moved before its car, and a list spine before the
+// values in it.
+void Heap::pushSlots(Value* v)
+{
+    switch (v->heapType())
+    {
+    case Value::PAIR:
+        slots.push_back(&((Pair*)v)->car);
+        slots.push_back(&((Pair*)v)->cdr);
+        break;
+
+    case Value::VECTOR:
+        {
+            std::vector<Value*>& values = ((Vector*)v)->values;
+            for (int i = (int)values.size() - 1; i >= 0; i--)
+                slots.push_back(&values[i]);
+        }
+        break;
+
+    case Value::CODE:
+        {
+            Code* c = (Code*)v;
+            releaseNative(c); // it has the old addresses in it, compiled again when hot
+            for (int i = (int)c->ops.size() - 1; i >= 0; i--)
+                slots.push_back(&c->ops[i].value);
+            for (int i = (int)c->constants.size() - 1; i >= 0; i--)
+                slots.push_back(&c->constants[i]);
+            for (int i = (int)c->regOps.size() - 1; i >= 0; i--)
+                slots.push_back(&c->regOps[i].value);
+            for (int i = 0; i < (int)c->formals.size(); i++)
+                slots.push_back((Value**)&c->formals[i]);
+            for (int i = 0; i < (int)c->locals.size(); i++)
+                slots.push_back((Value**)&c->locals[i]);
+            for (int i = 0; i < (int)c->captures.size(); i++)
+                slots.push_back((Value**)&c->captures[i]);
+            slots.push_back((Value**)&c->rest);
+        }
+        break;
+
+    case Value::CLOSURE:
+        slots.push_back((Value**)&((Closure*)v)->env);
+        slots.push_back((Value**)&((Closure*)v)->code);
+        break;
+
+    case Value::CONTINUATION:
+        {
+            Continuation* c = (Continuation*)v;
+            for (int i = (int)c->stack.size() - 1; i >= 0; i--)
+                slots.push_back(&c->stack[i]);
+            for (int i = (int)c->frames.size() - 1; i >= 0; i--)
+            {
+                slots.push_back((Value**)&c->frames[i].closure);
+                slots.push_back((Value**)&c->frames[i].env);
+            }
+        }
+        break;
+
+    case Value::ENV:
+        {
+            Env* e = (Env*)v;
+            for (int i = (int)e->slots.size() - 1; i >= 0; i--)
+                slots.push_back(&e->slots[i]);
+            for (std::map<Symbol*, Global*>::iterator iter = e->globals.begin(); iter != e->globals.end(); iter++)
+                slots.push_back((Value**)&iter->second);
+            if (!e->globals.empty())
+                rehash.push_back(e);
+            slots.push_back((Value**)&e->parent);
+        }
+        break;
+
+    case Value::GLOBAL:
+        slots.push_back((Value**)&((Global*)v)->sym);
+        slots.push_back(&((Global*)v)->value);
+        break;
+
+    default:
         break;
+    }
+}
+
+void Heap::startCompaction()
+{
+    // All survivors end up old.
+    for (int i = 0; i < (int)remembered.size(); i++)
+        remembered[i]->header &= ~Value::REMEMBERED_BIT;
+    remembered.clear();
+    young.clear();
+
+    for (int i = 0; i < (int)pools.size(); i++)
+        for (Page* page = pools[i].pages; page; page = page->next)
+            for (char* p = page->cells(); p < page->bump; p += pools[i].cellSize)
+            {
+                Value* v = (Value*)p;
+                if ((int)v->heapType() == FREE || !v->hasMark())
+                    continue;
+                if (!isMovable(v))
+                {
+                    if (!(v->header & Value::PINNED_BIT))
+                    {
+                        v->header |= Value::PINNED_BIT;
+                        pinned.push_back(v);
+                    }
+                    // Their references cannot be updated, so what they refer
+                    // to stays put too.
+                    v->markChildren();
+                    for (int j = 0; j < (int)Value::markStack.size(); j++)
+                    {
+                        Value* c = Value::markStack[j];
+                        if (!(c->header & Value::PINNED_BIT))
+                        {
+                            c->header |= Value::PINNED_BIT;
+                            pinned.push_back(c);
+                        }
+                    }
+                    Value::markStack.clear();
+                }
+            }
+
+    for (int i = 0; i < (int)pools.size(); i++)
+    {
+        Pool& pool = pools[i];
+        pool.from = pool.pages;
+        pool.pages = 0;
+        pool.current = 0;
+        pool.freeList = 0;
+    }
+
+    for (int i = 0; i < (int)pinned.size(); i++)
+        pushSlots(pinned[i]);
+}
+
+void Heap::forward(Value** slot)
+{
+    slots.push_back(slot);
+    while (!slots.empty())
+    {
+        Value** s = slots.back();
+        slots.pop_back();
+
+        Value* v = *s;
+        if (!v || !Value::isHeap(v) || (v->header & Value::PINNED_BIT))
+            continue;
+        if ((int)v->heapType() == FORWARDED)
+        {
+            *s = (Value*)((FreeCell*)v)->next;
+            continue;
+        }
+
+        Value* n = (Value*)allocateIn(pageOf(v)->pool);
+        relocate(v, n);
+        v->header = FORWARDED;
+        ((FreeCell*)v)->next = (FreeCell*)n;
+        *s = n;
+        pushSlots(n);
+    }
+}
+
+void Heap::finishCompaction()
+{
+    assert(slots.empty());
+
+    // Globals are keyed by symbol address.
+    for (int i = 0; i < (int)rehash.size(); i++)
+    {
+        std::map<Symbol*, Global*> globals;
+        std::map<Symbol*, Global*>& old = rehash[i]->globals;
+        for (std::map<Symbol*, Global*>::iterator iter = old.begin(); iter != old.end(); iter++)
+        {
+            Value* key = iter->first;
+            if ((int)key->heapType() == FORWARDED)
+                key = (Value*)((FreeCell*)key)->next;
+            globals[(Symbol*)key] = iter->second;
+        }
+        old.swap(globals);
+    }
+    rehash.clear();
+
+    // The old pages only keep the pinned values. Dead values are destroyed
+    // here; moved ones were destroyed when they were moved.
+    for (int i = 0; i < (int)pools.size(); i++)
+    {
+        Pool& pool = pools[i];
+        while (Page* page = pool.from)
+        {
+            pool.from = page->next;
+
+            FreeCell* freeList = pool.freeList;
+            int used = 0;
+            for (char* p = page->cells(); p < page->bump; p += pool.cellSize)
+            {
+                Value* v = (Value*)p;
+                int type = v->heapType();
+                if (type != FREE && type != FORWARDED)
+                {
+                    if (v->header & Value::PINNED_BIT)
+                    {
+                        v->header &= ~Value::PINNED_BIT;
+                        used++;
+                        continue;
+                    }
+                    Value::finalize(v);
+                    live--;
+                    liveBytes -= pool.cellSize;
+                }
+                FreeCell* c = (FreeCell*)p;
+                v->header = FREE;
+                c->next = freeList;
+                freeList = c;
+            }
+
+            if (used == 0)
+            {
+                freePage(page);
+                continue;
+            }
+            pool.freeList = freeList;
+            page->next = pool.pages;
+            pool.pages = page;
+        }
+    }
+    pinned.clear();
+}
+
+void Heap::markRemembered()
+{
+    for (int i = 0; i < (int)remembered.size(); i++)
+    {
+        remembered[i]->header &= ~Value::REMEMBERED_BIT;
+        remembered[i]->markChildren();
+    }
+    remembered.clear();
+}
+
+void Heap::sweepYoung()
+{
+    for (int i = 0; i < (int)young.size(); i++)
+    {
+        Value* v = young[i];
+        if (v->hasMark())
+            continue;
+        Pool& pool = pools[pageOf(v)->pool];
+        Value::finalize(v);
+        live--;
+        liveBytes -= pool.cellSize;
+
+        FreeCell* c = (FreeCell*)v;
+        v->header = FREE;
+        c->next = pool.freeList;
+        pool.freeList = c;
+    }
+    young.clear();
+}
+
+#define MARK(v) Value::mark(v)
+#define SL_MARK_KEYWORD(m, s) MARK(m);
+
+void Context::markRoots()
+{
+    MARK(error.sym);
+    MARK(error.param);
+    MARK(error.continuation);
+    MARK(currentContinuation); // collections may run from a procedure
+    for (int i = 0; i < (int)argBuffer.size(); i++)
+        MARK(argBuffer[i]); // and its arguments are only here
+    MARK(topEnv);
+    for (HandleBase* h = handles.next; h != &handles; h = h->next)
+        MARK(h->value);
+
+    SL_KEYWORDS(SL_MARK_KEYWORD)
+}
+
+// Values allocated since the last collection can be roots without any old
+// value pointing at them: bound global cells, which the top level
+// environment holds but is not rescanned for.
+void Context::markYoungRoots(int from)
+{
+    const std::vector<Value*>& young = heap.youngValues();
+    for (int i = from; i < (int)young.size(); i++)
+        if (young[i]->heapType() == Value::GLOBAL && ((Global*)young[i])->value)
+            MARK(young[i]);
+    youngScanned = young.size();
+}
+
+void Context::pruneTables()
+{
+    if (topEnv) // not while the Context is destroyed
+    {
+        std::map<Symbol*, Global*>& globals = topEnv->globals;
+        for (std::map<Symbol*, Global*>::iterator iter = globals.begin(); iter != globals.end(); )
+            if (iter->second->hasMark())
+                iter++;
+            else
+                globals.erase(iter++);
+    }
+
+    pruneSymbols();
+}
+
+void Context::gc()
+{
+    int all = INT_MAX;
+    if (phase == SWEEPING)
+        heap.sweepSome(all);
+    heap.discardMarking();
+    phase = IDLE;
+
+    heap.startClear();
+    heap.clearSome(all);
+    markRoots();
+    if (markThreads > 1)
+        Value::traceMarksParallel(markThreads);
+    else
+        Value::traceMarks();
+    pruneTables();
+    heap.startSweep();
+    heap.sweepSome(all);
+
+    allocatedAtLastGC = heap.allocatedBytes();
+    liveBytesAfterFullGC = heap.bytes();
+}
+
+void Context::compact()
+{
+    // The interpreter keeps raw pointers while it runs.
+    assert(!currentContinuation);
+
+    int all = INT_MAX;
+    if (phase == SWEEPING)
+        heap.sweepSome(all);
+    heap.discardMarking();
+    phase = IDLE;
+
+    heap.startClear();
+    heap.clearSome(all);
+    markRoots();
+    Value::traceMarks();
+    pruneTables();
+
+    heap.startCompaction();
+    heap.forward((Value**)&topEnv);
+    for (HandleBase* h = handles.next; h != &handles; h = h->next)
+        heap.forward(&h->value);
+    heap.forward(&error.sym);
+    heap.forward(&error.param);
+    heap.forward((Value**)&error.continuation);
+#define SL_FORWARD_KEYWORD(m, s) heap.forward(&m);
+    SL_KEYWORDS(SL_FORWARD_KEYWORD)
+#undef SL_FORWARD_KEYWORD
+    for (SymbolTable::iterator iter = symbols.begin(); iter != symbols.end(); iter++)
+        heap.forward(&iter->second);
+    for (FoldedSymbolTable::iterator iter = foldedSymbols.begin(); iter != foldedSymbols.end(); iter++)
+        heap.forward(&iter->second);
+    for (int i = 0; i < (int)argBuffer.size(); i++)
+        heap.forward(&argBuffer[i]);
+    heap.finishCompaction();
+
+    allocatedAtLastGC = heap.allocatedBytes();
+    liveBytesAfterFullGC = heap.bytes();
+}
+
+void Context::minorGC()
+{
+    // Old and young cannot be told apart while a full collection runs.
+    if (phase != IDLE)
+    {
+        increment(INT_MAX, 0);
+        allocatedAtLastGC = heap.allocatedBytes();
+        return;
+    }
 
-    case Code::CONS:
+    // Old values count as marked, so marking stops at them. The remembered
+    // set stands in for the old values that point back into the young
+    // generation.
+    markRoots();
+    markYoungRoots(0);
+    heap.markRemembered();
+    Value::traceMarks();
+
+    // Dead young symbols and cells still have table entries; only young
+    // values can have died, so there is no need to walk the tables.
+    const std::vector<Value*>& young = heap.youngValues();
+    bool lost = false;
+    for (int i = 0; i < (int)young.size(); i++)
+    {
+        Value* v = young[i];
+        if (v->hasMark())
+            continue;
+        if (v->heapType() == Value::SYMBOL)
         {
-            Value* cdr = st.back();
-            st.pop_back();
-            Value* car = st.back();
-            st.pop_back();
-            st.push_back(makePair(car, cdr));
+            Symbol* s = (Symbol*)v;
+            SymbolTable::iterator iter = symbols.find(s->s);
+            if (iter != symbols.end() && iter->second == s)
+                symbols.erase(iter);
+            FoldedSymbolTable::iterator iter2 = foldedSymbols.find(s->s);
+            if (iter2 != foldedSymbols.end() && iter2->second == s)
+            {
+                foldedSymbols.erase(iter2);
+                lost = true;
+            }
         }
-        break;
-
-    case Code::SPLICING:
+        else if (v->heapType() == Value::GLOBAL)
         {
-            Value* tail = st.back();
-            st.pop_back();
-            Value* list = st.back();
-            st.pop_back();
-            st.push_back(append(*this, list, tail));
+            std::map<Symbol*, Global*>::iterator iter = topEnv->globals.find(((Global*)v)->sym);
+            if (iter != topEnv->globals.end() && iter->second == v)
+                topEnv->globals.erase(iter);
         }
-        break;
+    }
 
-    case Code::APPLY:
-    case Code::TAIL_APPLY: // TODO: actually implement TAIL_APPLY
-        {
-            Value* args = nil();
-            for (int i = 0; i < op.i; i++)
+    // A dead symbol can only have shadowed spellings that were interned
+    // after it, which are young too.
+    if (lost)
+        for (int i = 0; i < (int)young.size(); i++)
+            if (young[i]->hasMark() && young[i]->heapType() == Value::SYMBOL)
             {
-                args = makePair((Value*)st.back(), (Value*)args);
-                st.pop_back();
+                Symbol* s = (Symbol*)young[i];
+                SymbolTable::iterator iter = symbols.find(s->s);
+                if (iter != symbols.end() && iter->second == s)
+                    foldedSymbols.insert(*iter);
             }
 
-            Value* callee = st.back();
-            st.pop_back();
-
-            apply(callee, args);
-        }
-        break;
-    }
-
-    currentContinuation = 0;
+    heap.sweepYoung();
+    youngScanned = 0;
+    allocatedAtLastGC = heap.allocatedBytes();
 }
 
-void Context::apply(Value* callee, Value* args)
+// Advances the incremental full collection. Marking is incremental update:
+// the write barrier remembers marked values that are given unmarked ones,
+// and every increment rescans them. The roots are not barriered, so the
+// end of marking rescans them in one go before the sweep starts. Returns the
+// work done.
+int Context::increment(int work, int micros)
 {
-    assert(currentContinuation);
-    Continuation* c = currentContinuation;
+    int done = 0;
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point deadline = Clock::now() + std::chrono::microseconds(micros);
 
-    if (callee->getType() == Value::PROCEDURE)
+    heap.resumeMarking();
+    while (phase != IDLE && work > 0)
     {
-        Value* v = callee->getProcedure()->proc(*this, args);
-        assert((v == 0) == hasError());
-
-        if (hasError())
+        int budget = std::min(work, 1024);
+        int slice = budget;
+        switch (phase)
         {
-            error.continuation = currentContinuation;
-            return;
-        }
+        case IDLE:
+            break;
 
-        if (v != omitted())
-            c->stack.push_back(v);
-    }
-    else if (callee->getType() == Value::CLOSURE)
-    {
-        Continuation::Frame f = applyClosure(callee->getClosure(), args);
-        if (!hasError())
-            c->frames.push_back(f);
-    }
-    else if (callee->getType() == Value::CONTINUATION)
-    {
-        *getCurrentContinuation() = *callee->getContinuation();
-        getCurrentContinuation()->stack.push_back(args->getPair()->car);
-    }
-    else
-    {
-        printValue(*this, callee, 8);
-        assert(0);
+        case CLEARING:
+            if (heap.clearSome(budget))
+            {
+                markRoots();
+                phase = MARKING;
+            }
+            break;
+
+        case MARKING:
+            heap.markRemembered();
+            markYoungRoots(youngScanned);
+            if (Value::traceMarks(budget))
+            {
+                markRoots();
+                heap.markRemembered();
+                markYoungRoots(youngScanned);
+                Value::traceMarks();
+                pruneTables();
+                heap.startSweep();
+                phase = SWEEPING;
+            }
+            break;
+
+        case SWEEPING:
+            if (heap.sweepSome(budget))
+            {
+                youngScanned = 0;
+                liveBytesAfterFullGC = heap.bytes();
+                phase = IDLE;
+            }
+            break;
+        }
+        work -= slice - budget;
+        done += slice - budget;
+        if (micros && Clock::now() >= deadline)
+            break;
     }
+    heap.suspendMarking();
+    return done;
 }
 
-Continuation::Frame Context::applyClosure(Closure* c, Value* args)
-{
-    Env&        env  = *makeEnv(c->env);
-    const Code& code = *c->code;
+#undef SL_MARK_KEYWORD
+#undef MARK
 
-    for (int i = 0; i < (int)code.formals.size(); i++)
+void Context::collect()
+{
+    if (phase == IDLE)
     {
-        if (args->getType() != Value::PAIR)
+        size_t old = heap.bytes() - (heap.allocatedBytes() - allocatedAtLastGC);
+        if (old <= heapGrowth * std::max(liveBytesAfterFullGC, nurseryBytes))
         {
-            setError(sym("bad-argument-count"), args, 0);
-            return Continuation::Frame(0, 0);
+            minorGC();
+            return;
         }
-        env.setSymbolLocal(code.formals[i], args->getPair()->car);
-        args = args->getPair()->cdr;
+        heap.startClear();
+        youngScanned = 0;
+        phase = CLEARING;
+
+        // Clearing and sweeping visit every cell, of the pages there are now
+        // and of those allocated during the cycle, and marking every live
+        // value. Cells take at least two size classes. The cycle may
+        // allocate what the growth factor allows.
+        const int minCell = 2 * Heap::SIZE_CLASS;
+        size_t allowance = std::max((size_t)((heapGrowth - 1) * heap.bytes()), nurseryBytes);
+        double cells = (double)heap.pages() * (Heap::PAGE_SIZE / minCell);
+        workPerByte = (2 * cells + heap.count()) / allowance + 1.0 / minCell;
+        cycleLimit = heap.bytes() + 2 * allowance;
     }
 
-    if (code.rest)
-        env.setSymbolLocal(code.rest, (Value*)args);
-    else if (args != nil())
+    if (heap.bytes() > cycleLimit)
     {
-        setError(sym("bad-argument-count"), args, 0);
-        return Continuation::Frame(0, 0);
+        increment(INT_MAX, 0);
+        allocatedAtLastGC = heap.allocatedBytes();
+        return;
     }
 
-    return Continuation::Frame(&env, c);
+    // Work that the budget or the clock cut short is owed at the next
+    // safepoint.
+    size_t allocated = heap.allocatedBytes() - allocatedAtLastGC;
+    int done = increment((int)std::min(allocated * workPerByte + 1, (double)incrementWork), incrementMicros);
+    allocatedAtLastGC += std::min(allocated, (size_t)(done / workPerByte));
+    if (phase == IDLE)
+        allocatedAtLastGC = heap.allocatedBytes();
+    incrementBytes = std::max((size_t)1, std::min((size_t)INCREMENT_BYTES, (size_t)(incrementWork / workPerByte)));
 }
 
 //
-// Execute and eval.
+// Bignums.
 //
 
-Value* Context::annotate(Value* v, const std::map<Value*, FilePos>& pos)
+// Magnitudes are vectors of base 2^32 digits, least significant first, with
+// no leading zero digits. Zero is the empty vector.
+
+typedef std::vector<uint32_t> Digits;
+
+enum { KARATSUBA_THRESHOLD = 32 };
+
+static void trim(Digits& a)
 {
-    Value* pv;
-    if (pos.find(v) == pos.end())
-        pv = nil();
-    else
-        pv = makePair(pos.find(v)->second.f, makeNumber(pos.find(v)->second.p));
+    while (!a.empty() && a.back() == 0)
+        a.pop_back();
+}
 
-    if (v->getType() == Value::PAIR)
-        return makePair(makePair(annotate(v->getPair()->car, pos), annotate(v->getPair()->cdr, pos)), pv);
-    else
-        return makePair(v, pv);
+static Digits digitsOf(unsigned long v)
+{
+    Digits d;
+    for (; v; v >>= 32)
+        d.push_back((uint32_t)v);
+    return d;
 }
 
-Value* Context::unannotate(Value* v, std::map<Value*, FilePos>& pos)
+static int compareDigits(const Digits& a, const Digits& b)
+{
+    if (a.size() != b.size())
+        return a.size() < b.size() ? -1 : 1;
+    for (int i = (int)a.size() - 1; i >= 0; i--)
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1 : 1;
+    return 0;
+}
+
+static Digits addDigits(const Digits& a, const Digits& b)
 {
-    if (v->getType() != Value::PAIR)
+    const Digits& x = a.size() >= b.size() ? a : b;
+    const Digits& y = a.size() >= b.size() ? b : a;
+
+    Digits r(x.size() + 1);
+    uint64_t carry = 0;
+    for (int i = 0; i < (int)x.size(); i++)
     {
-        setError(sym("unannotate-failed"), v, 0);
-        return 0;
+        carry += (uint64_t)x[i] + (i < (int)y.size() ? y[i] : 0);
+        r[i] = (uint32_t)carry;
+        carry >>= 32;
     }
+    r[x.size()] = (uint32_t)carry;
+    trim(r);
+    return r;
+}
 
-    Pair* p = v->getPair();
-    FilePos fp;
-    if (p->cdr->getType() == Value::PAIR)
+// Requires a >= b.
+static Digits subDigits(const Digits& a, const Digits& b)
+{
+    Digits r(a.size());
+    int64_t borrow = 0;
+    for (int i = 0; i < (int)a.size(); i++)
     {
-        Pair* p2 = p->cdr->getPair();
-        if (p2->car->getType() == Value::SYMBOL)
-            fp.f = p2->car->getSymbol();
-        if (p2->getType() == Value::NUMBER)
-            fp.p = int(p2->cdr->getNumber()->v);
+        int64_t t = (int64_t)a[i] - (i < (int)b.size() ? b[i] : 0) - borrow;
+        borrow = t < 0;
+        r[i] = (uint32_t)(t + (borrow << 32));
     }
+    assert(!borrow);
+    trim(r);
+    return r;
+}
 
-    Value* ret;
-    if (p->car->getType() == Value::PAIR)
+static Digits shiftDigits(const Digits& a, int n)
+{
+    if (a.empty())
+        return a;
+    Digits r(n, 0);
+    r.insert(r.end(), a.begin(), a.end());
+    return r;
+}
+
+static Digits schoolbookMul(const Digits& a, const Digits& b)
+{
+    Digits r(a.size() + b.size(), 0);
+    for (int i = 0; i < (int)a.size(); i++)
     {
-        Pair* p2 = p->car->getPair();
-        ret = makePair(unannotate(p2->car, pos), unannotate(p2->cdr, pos));
+        uint64_t carry = 0;
+        for (int j = 0; j < (int)b.size(); j++)
+        {
+            carry += (uint64_t)a[i] * b[j] + r[i + j];
+            r[i + j] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        r[i + b.size()] = (uint32_t)carry;
     }
-    else
-        ret = p->car;
+    trim(r);
+    return r;
+}
 
-    pos[ret] = fp;
-    return ret;
+static Digits mulDigits(const Digits& a, const Digits& b)
+{
+    if ((int)a.size() < KARATSUBA_THRESHOLD || (int)b.size() < KARATSUBA_THRESHOLD)
+        return schoolbookMul(a, b);
+
+    // Karatsuba: with x = x1 B^k + x0, x*y = z2 B^2k + z1 B^k + z0 where
+    // z1 = (x0 + x1)(y0 + y1) - z2 - z0.
+    int k = (int)std::max(a.size(), b.size()) / 2;
+
+    Digits a0(a.begin(), a.begin() + std::min((int)a.size(), k)), a1;
+    Digits b0(b.begin(), b.begin() + std::min((int)b.size(), k)), b1;
+    if ((int)a.size() > k)
+        a1.assign(a.begin() + k, a.end());
+    if ((int)b.size() > k)
+        b1.assign(b.begin() + k, b.end());
+    trim(a0);
+    trim(b0);
+
+    Digits z0 = mulDigits(a0, b0);
+    Digits z2 = mulDigits(a1, b1);
+    Digits z1 = subDigits(subDigits(mulDigits(addDigits(a0, a1), addDigits(b0, b1)), z2), z0);
+
+    return addDigits(addDigits(shiftDigits(z2, 2 * k), shiftDigits(z1, k)), z0);
 }
 
-Value* Context::macroExpand(Value* v, const std::map<Value*, FilePos>& pos, std::map<Value*, FilePos>& pos2)
+static uint32_t divSmall(Digits& a, uint32_t d)
 {
-    Value* e = topEnv->findSymbol(sym("macro-expander"));
-    if (!e)
+    uint64_t rem = 0;
+    for (int i = (int)a.size() - 1; i >= 0; i--)
     {
-        pos2 = pos;
-        return v;
+        uint64_t cur = (rem << 32) | a[i];
+        a[i] = (uint32_t)(cur / d);
+        rem = cur % d;
     }
-    if (e->getType() != Value::CLOSURE)
+    trim(a);
+    return (uint32_t)rem;
+}
+
+static void mulSmallAdd(Digits& a, uint32_t m, uint32_t add)
+{
+    uint64_t carry = add;
+    for (int i = 0; i < (int)a.size(); i++)
     {
-        setError(sym("bad-macro-expander"), e, 0);
-        return 0;
+        carry += (uint64_t)a[i] * m;
+        a[i] = (uint32_t)carry;
+        carry >>= 32;
     }
+    if (carry)
+        a.push_back((uint32_t)carry);
+}
 
-    Value* res = nil();
+// Knuth's algorithm D. Returns the quotient and leaves the remainder in u.
+static Digits divDigits(Digits& u, const Digits& v)
+{
+    assert(!v.empty());
 
-    while (v->getType() == Value::PAIR)
-    {
-        Continuation::Frame f = applyClosure(e->getClosure(), makePair(annotate(v->getPair()->car, pos), nil()));
-        if (hasError())
-            return 0;
+    if (compareDigits(u, v) < 0)
+        return Digits();
 
-        v = v->getPair()->cdr;
+    if (v.size() == 1)
+    {
+        Digits q = u;
+        u = digitsOf(divSmall(q, v[0]));
+        return q;
+    }
 
-        Continuation* c = makeContinuation();
-        c->frames.push_back(f);
+    int n = v.size();
+    int m = u.size() - n;
+    int s = __builtin_clz(v.back());
+
+    Digits vn(n), un(u.size() + 1);
+    for (int i = n - 1; i > 0; i--)
+        vn[i] = (v[i] << s) | (s ? (uint32_t)((uint64_t)v[i-1] >> (32 - s)) : 0);
+    vn[0] = v[0] << s;
+    un[u.size()] = s ? (uint32_t)((uint64_t)u.back() >> (32 - s)) : 0;
+    for (int i = (int)u.size() - 1; i > 0; i--)
+        un[i] = (u[i] << s) | (s ? (uint32_t)((uint64_t)u[i-1] >> (32 - s)) : 0);
+    un[0] = u[0] << s;
+
+    Digits q(m + 1);
+    for (int j = m; j >= 0; j--)
+    {
+        uint64_t num  = ((uint64_t)un[j+n] << 32) | un[j+n-1];
+        uint64_t qhat = num / vn[n-1];
+        uint64_t rhat = num % vn[n-1];
 
-        while (!c->frames.empty())
+        while (qhat >> 32 || qhat * vn[n-2] > ((rhat << 32) | un[j+n-2]))
         {
-            v->incRef();
-            step(c);
-            v->decRef();
-
-            if (hasError())
-                return 0;
+            qhat--;
+            rhat += vn[n-1];
+            if (rhat >> 32)
+                break;
         }
 
-        assert(c->stack.size() == 1);
+        int64_t k = 0, t;
+        for (int i = 0; i < n; i++)
+        {
+            uint64_t p = qhat * vn[i];
+            t = (int64_t)un[i+j] - k - (int64_t)(p & 0xffffffff);
+            un[i+j] = (uint32_t)t;
+            k = (int64_t)(p >> 32) - (t >> 32);
+        }
+        t = (int64_t)un[j+n] - k;
+        un[j+n] = (uint32_t)t;
 
-        Value* prevRes = res;
-        res = makePair(unannotate(c->stack.back(), pos2), res);
-        res->incRef();
-        if (prevRes != nil())
-            prevRes->decRef();
+        q[j] = (uint32_t)qhat;
+        if (t < 0)
+        {
+            q[j]--;
+            uint64_t c = 0;
+            for (int i = 0; i < n; i++)
+            {
+                c += (uint64_t)un[i+j] + vn[i];
+                un[i+j] = (uint32_t)c;
+                c >>= 32;
+            }
+            un[j+n] += (uint32_t)c;
+        }
     }
 
-    if (res != nil())
-        res->decRef();
-    return reverse(res, nil());
+    u.resize(n);
+    for (int i = 0; i < n; i++)
+        u[i] = (un[i] >> s) | (s ? (uint32_t)((uint64_t)un[i+1] << (32 - s)) : 0);
+    trim(u);
+    trim(q);
+    return q;
 }
 
-Value* Context::execute(const char* s, Symbol* file)
+// Signed integer in sign-magnitude form, used for the slow paths.
+struct Integer
 {
-    assert(!hasError());
+    Integer(bool n, const Digits& d) : negative(n && !d.empty()), digits(d) {}
 
-    std::map<Value*, FilePos> pos2;
-    Value* sl = parseSExpList(s, file, &pos2);
-    if (!sl)
-        return 0;
+    bool   negative;
+    Digits digits;
+};
 
-    std::map<Value*, FilePos> pos;
-    sl = macroExpand(sl, pos2, pos);
-    if (!sl)
-        return 0;
+static Integer toInteger(Value* v)
+{
+    if (Value::isFixnum(v))
+    {
+        long i = fixnumValue(v);
+        return Integer(i < 0, digitsOf(i < 0 ? 0UL - (unsigned long)i : (unsigned long)i));
+    }
+    return Integer(v->getBignum()->negative, v->getBignum()->digits);
+}
 
-    Code* code = compile(sl, pos);
+static Integer addIntegers(const Integer& a, const Integer& b)
+{
+    if (a.negative == b.negative)
+        return Integer(a.negative, addDigits(a.digits, b.digits));
+    if (compareDigits(a.digits, b.digits) >= 0)
+        return Integer(a.negative, subDigits(a.digits, b.digits));
+    return Integer(b.negative, subDigits(b.digits, a.digits));
+}
 
-    Closure* closure = makeClosure(topEnv, code);
+static int compareIntegers(const Integer& a, const Integer& b)
+{
+    if (a.negative != b.negative)
+        return a.negative ? -1 : 1;
+    int c = compareDigits(a.digits, b.digits);
+    return a.negative ? -c : c;
+}
 
-    Continuation* c = makeContinuation();
-    c->frames.push_back(Continuation::Frame(topEnv, closure));
+static double bignumToDouble(Bignum* b)
+{
+    double d = 0;
+    for (int i = (int)b->digits.size() - 1; i >= 0; i--)
+        d = d * 4294967296.0 + b->digits[i];
+    return b->negative ? -d : d;
+}
+
+Value* Context::makeBignum(long i)
+{
+    unsigned long m = i < 0 ? 0UL - (unsigned long)i : (unsigned long)i;
+    return makeBignum(i < 0, digitsOf(m));
+}
 
-    while (!c->frames.empty())
+Value* Context::makeBignum(bool negative, const std::vector<uint32_t>& digits)
+{
+    // Normalize: anything that fits is returned as a fixnum.
+    if (digits.size() <= 2)
     {
-        step(c);
-        if (hasError())
-            return 0;
+        uint64_t m = digits.empty() ? 0 : digits[0] | (digits.size() > 1 ? (uint64_t)digits[1] << 32 : 0);
+        if (!negative && m <= (uint64_t)Value::FIXNUM_MAX)
+            return makeInteger((long)m);
+        if (negative && m <= (uint64_t)Value::FIXNUM_MAX + 1)
+            return makeInteger((long)(0 - m));
     }
-
-    assert(c->stack.size() == 1);
-    return (Value*)c->stack.back();
+    return newValue<Bignum>(negative, digits);
 }
 
-//
-// Garbage collection.
-//
-
-void Context::gc()
+static Value* integerValue(Context& ctx, const Integer& i)
 {
-#define MARK(v) { if (v) (v)->mark(); }
+    return ctx.makeBignum(i.negative, i.digits);
+}
 
-    for (int i = 0; i < (int)values.size(); i++)
-        values[i]->clearMark();
+static Value* parseBignum(Context& ctx, const char* p, const char* end)
+{
+    bool negative = *p == '-';
+    if (*p == '-' || *p == '+')
+        p++;
 
-    MARK(error.param);
-    MARK(error.continuation);
+    int base = 10;
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+    {
+        base = 16;
+        p += 2;
+    }
 
-    for (int i = 0; i < (int)values.size(); i++)
-        if (values[i]->hasRefs())
-            MARK(values[i]);
+    Digits d;
+    for (; p < end; p++)
+    {
+        int c = tolower((unsigned char)*p);
+        mulSmallAdd(d, base, (c >= 'a') ? c - 'a' + 10 : c - '0');
+    }
+    trim(d);
+    return ctx.makeBignum(negative, d);
+}
 
-    int m = 0;
-    for (int i = 0; i < (int)symbols.size(); i++)
-        if (symbols[i]->hasMark())
-            symbols[m++] = symbols[i];
+std::string sl::numberToString(Value* v)
+{
+    char buffer[64];
 
-    //printf("GC SYMBOLS %d => %d\n", (int)symbols.size(), m);
-    symbols.resize(m);
+    if (Value::isFixnum(v))
+    {
+        snprintf(buffer, sizeof(buffer), "%ld", fixnumValue(v));
+        return buffer;
+    }
 
-    int n = 0;
-    for (int i = 0; i < (int)values.size(); i++)
-        if (values[i]->hasMark())
-            values[n++] = values[i];
-        else
-            delete values[i];
+    if (v->heapType() == Value::FLONUM)
+    {
+        snprintf(buffer, sizeof(buffer), "%.17g", v->getFlonum()->d);
+        return buffer;
+    }
 
-    //printf("GC VALUES %d => %d\n", (int)values.size(), n);
-    values.resize(n);
+    // Peel off nine decimal digits per division so the quadratic part works
+    // on whole machine words.
+    Digits d = v->getBignum()->digits;
+    std::vector<uint32_t> chunks;
+    while (!d.empty())
+        chunks.push_back(divSmall(d, 1000000000));
+
+    std::string s = v->getBignum()->negative ? "-" : "";
+    snprintf(buffer, sizeof(buffer), "%u", chunks.back());
+    s += buffer;
+    for (int i = (int)chunks.size() - 2; i >= 0; i--)
+    {
+        snprintf(buffer, sizeof(buffer), "%09u", chunks[i]);
+        s += buffer;
+    }
+    return s;
 }
 
 //
@@ -880,36 +4638,40 @@ void Context::gc()
 //
 
 #define BEGIN_PROCEDURE(name) \
-static Value* s_##name(Context& ctx, Value* args)
-#define MATCH(pattern) if (!match(ctx, pattern, args)) return 0
+static Value* s_##name(Context& ctx, int argc, Value** argv)
+#define MATCH(pattern) if (!match(ctx, pattern, argc, argv)) return 0
 
-#define ARG0 args->getPair()->car
-#define ARG1 args->getPair()->cdr->getPair()->car
+#define ARG0 argv[0]
+#define ARG1 argv[1]
 
-static bool match(Context& ctx, const char* p, Value* args)
+static bool match(Context& ctx, const char* p, int argc, Value** argv)
 {
-    while (*p != '\0' && args->getType() == Value::PAIR)
+    int i = 0;
+    for (; *p != '\0' && i < argc; i++)
     {
+        Value*  arg = argv[i];
         Symbol* err = 0;
-        if (*p == 'p' && args->getPair()->car->getType() != Value::PAIR)
+        if (*p == 'p' && typeOf(arg) != Value::PAIR)
             err = ctx.sym("expecting-pair");
-        if (*p == 'n' && args->getPair()->car->getType() != Value::NUMBER)
+        if (*p == 'n' && !isNumber(arg))
             err = ctx.sym("expecting-number");
-        if (*p == 'b' && args->getPair()->car->getType() != Value::BOOLEAN)
+        if (*p == 'i' && !Value::isFixnum(arg))
+            err = ctx.sym("expecting-fixnum");
+        if (*p == 'b' && typeOf(arg) != Value::BOOLEAN)
             err = ctx.sym("expecting-boolean");
-        if (*p == 's' && args->getPair()->car->getType() != Value::SYMBOL)
+        if (*p == 's' && typeOf(arg) != Value::SYMBOL)
             err = ctx.sym("expecting-symbol");
-        if (*p == 'S' && args->getPair()->car->getType() != Value::STRING)
+        if (*p == 'S' && typeOf(arg) != Value::STRING)
             err = ctx.sym("expecting-string");
-        if (*p == 'q' && (args->getPair()->car->getType() != Value::CLOSURE && args->getPair()->car->getType() != Value::PROCEDURE))
+        if (*p == 'q' && (typeOf(arg) != Value::CLOSURE && typeOf(arg) != Value::PROCEDURE))
             err = ctx.sym("expecting-closure");
-        if (*p == 'w' && args->getPair()->car->getType() != Value::CODE)
+        if (*p == 'w' && typeOf(arg) != Value::CODE)
             err = ctx.sym("expecting-code");
-        if (*p == 'o' && args->getPair()->car->getType() != Value::PORT)
+        if (*p == 'o' && typeOf(arg) != Value::PORT)
             err = ctx.sym("expecting-port");
-        if (*p == 'c' && args->getPair()->car->getType() != Value::CHAR)
+        if (*p == 'c' && typeOf(arg) != Value::CHAR)
             err = ctx.sym("expecting-char");
-        if (*p == 'l' && (args->getPair()->car->getType() != Value::NIL && args->getPair()->car->getType() != Value::PAIR))
+        if (*p == 'l' && (typeOf(arg) != Value::NIL && typeOf(arg) != Value::PAIR))
             err = ctx.sym("expecting-list");
 
         if (err)
@@ -919,7 +4681,6 @@ static bool match(Context& ctx, const char* p, Value* args)
         }
 
         p++;
-        args = args->getPair()->cdr;
     }
 
     if (*p != '\0')
@@ -928,7 +4689,7 @@ static bool match(Context& ctx, const char* p, Value* args)
         return false;
     }
 
-    if (args->getType() != Value::NIL)
+    if (i != argc)
     {
         ctx.setError(ctx.sym("bad-argument-count"), ctx.sym("too-many"), 0);
         return false;
@@ -945,34 +4706,165 @@ BEGIN_PROCEDURE(n) { \
 SIMPLE_PROCEDURE(cons,      "..", ctx.makePair(ARG0, ARG1))
 SIMPLE_PROCEDURE(car,       "p",  ARG0->getPair()->car)
 SIMPLE_PROCEDURE(cdr,       "p",  ARG0->getPair()->cdr)
-SIMPLE_PROCEDURE(set_car,   "p.", ((ARG0->getPair()->car = ARG1), ctx.nil()))
-SIMPLE_PROCEDURE(set_cdr,   "p.", ((ARG0->getPair()->cdr = ARG1), ctx.nil()))
-SIMPLE_PROCEDURE(add2,      "nn", ctx.makeNumber(ARG0->getNumber()->v + ARG1->getNumber()->v))
-SIMPLE_PROCEDURE(sub2,      "nn", ctx.makeNumber(ARG0->getNumber()->v - ARG1->getNumber()->v))
-SIMPLE_PROCEDURE(mul2,      "nn", ctx.makeNumber(ARG0->getNumber()->v * ARG1->getNumber()->v))
-SIMPLE_PROCEDURE(div2,      "nn", ctx.makeNumber(ARG0->getNumber()->v / ARG1->getNumber()->v))
-SIMPLE_PROCEDURE(lt,        "nn", ctx.makeBoolean(ARG0->getNumber()->v < ARG1->getNumber()->v))
-SIMPLE_PROCEDURE(gt,        "nn", ctx.makeBoolean(ARG0->getNumber()->v > ARG1->getNumber()->v))
-SIMPLE_PROCEDURE(le,        "nn", ctx.makeBoolean(ARG0->getNumber()->v <= ARG1->getNumber()->v))
-SIMPLE_PROCEDURE(ge,        "nn", ctx.makeBoolean(ARG0->getNumber()->v >= ARG1->getNumber()->v))
-SIMPLE_PROCEDURE(eqnum,     "nn", ctx.makeBoolean(ARG0->getNumber()->v == ARG1->getNumber()->v))
+SIMPLE_PROCEDURE(set_car,   "p.", ((ARG0->getPair()->car = ARG1), ctx.writeBarrier(ARG0, ARG1), ctx.nil()))
+SIMPLE_PROCEDURE(set_cdr,   "p.", ((ARG0->getPair()->cdr = ARG1), ctx.writeBarrier(ARG0, ARG1), ctx.nil()))
+// Numeric procedures take the fixnum path when both operands are fixnums. It
+// works on the tagged words directly and falls back to the slow path only
+// when the result overflows. The slow path computes on unboxed doubles when
+// either operand is a flonum and on bignums otherwise.
+
+static double toDouble(Value* v)
+{
+    if (Value::isFixnum(v))
+        return (double)fixnumValue(v);
+    if (v->heapType() == Value::BIGNUM)
+        return bignumToDouble(v->getBignum());
+    return v->getFlonum()->d;
+}
+
+static bool isExact(Value* v)
+{
+    return Value::isFixnum(v) || v->heapType() == Value::BIGNUM;
+}
+
+// With a = 2x+1 and b = 2y+1: a + (b-1) = 2(x+y)+1, a - (b-1) = 2(x-y)+1 and
+// (a>>1) * (b-1) + 1 = 2xy+1. The machine overflows exactly when the fixnum
+// result would.
+
+static inline bool fixnumAdd(Value* a, Value* b, Value*& r)
+{
+    intptr_t t;
+    if (__builtin_add_overflow((intptr_t)a, (intptr_t)b - 1, &t))
+        return false;
+    r = (Value*)t;
+    return true;
+}
+
+static inline bool fixnumSub(Value* a, Value* b, Value*& r)
+{
+    intptr_t t;
+    if (__builtin_sub_overflow((intptr_t)a, (intptr_t)b - 1, &t))
+        return false;
+    r = (Value*)t;
+    return true;
+}
+
+static inline bool fixnumMul(Value* a, Value* b, Value*& r)
+{
+    intptr_t t;
+    if (__builtin_mul_overflow((intptr_t)a >> 1, (intptr_t)b - 1, &t))
+        return false;
+    r = (Value*)(t + 1);
+    return true;
+}
+
+static Value* addSlow(Context& ctx, Value* a, Value* b)
+{
+    if (!isExact(a) || !isExact(b))
+        return ctx.makeNumber(toDouble(a) + toDouble(b));
+    return integerValue(ctx, addIntegers(toInteger(a), toInteger(b)));
+}
+
+static Value* subSlow(Context& ctx, Value* a, Value* b)
+{
+    if (!isExact(a) || !isExact(b))
+        return ctx.makeNumber(toDouble(a) - toDouble(b));
+    Integer y = toInteger(b);
+    y.negative = !y.negative && !y.digits.empty();
+    return integerValue(ctx, addIntegers(toInteger(a), y));
+}
+
+static Value* mulSlow(Context& ctx, Value* a, Value* b)
+{
+    if (!isExact(a) || !isExact(b))
+        return ctx.makeNumber(toDouble(a) * toDouble(b));
+    Integer x = toInteger(a), y = toInteger(b);
+    return integerValue(ctx, Integer(x.negative != y.negative, mulDigits(x.digits, y.digits)));
+}
+
+static int compareSlow(Value* a, Value* b)
+{
+    if (!isExact(a) || !isExact(b))
+    {
+        double x = toDouble(a), y = toDouble(b);
+        return (x < y) ? -1 : (x > y) ? 1 : 0;
+    }
+    return compareIntegers(toInteger(a), toInteger(b));
+}
+
+#define ARITH_PROCEDURE(n, f) \
+BEGIN_PROCEDURE(n) { \
+    MATCH("nn"); \
+    Value* r; \
+    if (Value::isFixnum(ARG0) && Value::isFixnum(ARG1) && f(ARG0, ARG1, r)) \
+        return r; \
+    return n##Slow(ctx, ARG0, ARG1); }
+
+#define COMPARE_PROCEDURE(n, o) \
+BEGIN_PROCEDURE(n) { \
+    MATCH("nn"); \
+    if (Value::isFixnum(ARG0) && Value::isFixnum(ARG1)) \
+        return ctx.makeBoolean((intptr_t)ARG0 o (intptr_t)ARG1); \
+    return ctx.makeBoolean(compareSlow(ARG0, ARG1) o 0); }
+
+ARITH_PROCEDURE(add, fixnumAdd)
+ARITH_PROCEDURE(sub, fixnumSub)
+ARITH_PROCEDURE(mul, fixnumMul)
+COMPARE_PROCEDURE(lt,    <)
+COMPARE_PROCEDURE(gt,    >)
+COMPARE_PROCEDURE(le,    <=)
+COMPARE_PROCEDURE(ge,    >=)
+COMPARE_PROCEDURE(eqnum, ==)
+
+BEGIN_PROCEDURE(div)
+{
+    MATCH("nn");
+
+    if (!isExact(ARG0) || !isExact(ARG1))
+        return ctx.makeNumber(toDouble(ARG0) / toDouble(ARG1));
+
+    if (ARG1 == ctx.makeInteger(0))
+    {
+        ctx.setError(ctx.sym("division-by-zero"), ARG0, 0);
+        return 0;
+    }
+
+    // FIXNUM_MIN / -1 is the only fixnum quotient that does not fit.
+    if (Value::isFixnum(ARG0) && Value::isFixnum(ARG1) && !(fixnumValue(ARG0) == Value::FIXNUM_MIN && fixnumValue(ARG1) == -1))
+        return ctx.makeInteger(fixnumValue(ARG0) / fixnumValue(ARG1));
+
+    Integer x = toInteger(ARG0), y = toInteger(ARG1);
+    return integerValue(ctx, Integer(x.negative != y.negative, divDigits(x.digits, y.digits)));
+}
+
+BEGIN_PROCEDURE(number_to_string)
+{
+    MATCH("n");
+    return ctx.makeString(numberToString(ARG0));
+}
+
 SIMPLE_PROCEDURE(eq,        "..", ctx.makeBoolean(ARG0 == ARG1))
 SIMPLE_PROCEDURE(symbol_to_string, "s",  ctx.makeString(ARG0->getSymbol()->s))
-SIMPLE_PROCEDURE(string_ref,       "Sn", ctx.makeChar(ARG0->getString()->s.at(ARG1->getNumber()->v)))
-SIMPLE_PROCEDURE(string_length,    "S",  ctx.makeNumber(ARG0->getString()->s.length()))
+SIMPLE_PROCEDURE(string_ref,       "Si", ctx.makeChar(ARG0->getString()->s.at(fixnumValue(ARG1))))
+SIMPLE_PROCEDURE(string_length,    "S",  ctx.makeInteger(ARG0->getString()->s.length()))
 
 #define PREDICATE(n, t) \
 BEGIN_PROCEDURE(n) { \
     MATCH("."); \
-    return ctx.makeBoolean(ARG0->getType() == Value::t); }
+    return ctx.makeBoolean(typeOf(ARG0) == Value::t); }
 
 PREDICATE(null,    NIL)
 PREDICATE(pair,    PAIR)
 PREDICATE(boolean, BOOLEAN)
-PREDICATE(number,  NUMBER)
 PREDICATE(symbol,  SYMBOL)
 PREDICATE(port,    PORT)
 
+BEGIN_PROCEDURE(number)
+{
+    MATCH(".");
+    return ctx.makeBoolean(isNumber(ARG0));
+}
+
 BEGIN_PROCEDURE(assert)
 {
     MATCH("b");
@@ -990,7 +4882,7 @@ BEGIN_PROCEDURE(error)
 BEGIN_PROCEDURE(write_char)
 {
     MATCH("co");
-    char ch = ARG0->getChar()->ch;
+    char ch = charValue(ARG0);
     ARG1->getPort()->write(&ch, 1);
     return ctx.nil();
 }
@@ -998,8 +4890,14 @@ BEGIN_PROCEDURE(write_char)
 BEGIN_PROCEDURE(apply)
 {
     MATCH("ql");
-    ctx.apply(ARG0, ARG1);
-    return ctx.omitted();
+
+    // This is the one place where an argument list has to be spread out.
+    std::vector<Value*> args;
+    for (Value* v = ARG1; typeOf(v) == Value::PAIR; v = v->getPair()->cdr)
+        args.push_back(v->getPair()->car);
+
+    ctx.apply(ARG0, args.size(), args.empty() ? 0 : &args[0]);
+    return ctx.hasError() ? 0 : ctx.omitted();
 }
 
 BEGIN_PROCEDURE(callcc)
@@ -1007,62 +4905,65 @@ BEGIN_PROCEDURE(callcc)
     MATCH("q");
     Continuation* c = ctx.makeContinuation();
     *c = *ctx.getCurrentContinuation();
-    ctx.apply(ARG0, ctx.makePair(c, ctx.nil()));
-    return ctx.omitted();
+    Value* arg = c;
+    ctx.apply(ARG0, 1, &arg);
+    return ctx.hasError() ? 0 : ctx.omitted();
 }
 
 struct FILEPort : public Port
 {
-    FILEPort(FILE* fp, int m) : fp(fp), m(m) {}
+    FILEPort(FILE* fp, int m) : Port(&portClass, m), fp(fp) {}
 
-    int write(const void* b, int s)
+    static int write(Port* p, const void* b, int s)
     {
-        return fwrite(b, s, 1, fp);
+        return fwrite(b, s, 1, ((FILEPort*)p)->fp);
     }
 
-    int read(void* b, int s)
+    static int read(Port* p, void* b, int s)
     {
-        return fread(b, s, 1, fp);
+        return fread(b, s, 1, ((FILEPort*)p)->fp);
     }
 
-    int mode() { return m; }
+    static const Class portClass;
 
     FILE* fp;
-    int   m;
 };
 
+const Port::Class FILEPort::portClass("file-port", sizeof(FILEPort), 0, 0, FILEPort::write, FILEPort::read);
+
 void Context::initStandardLibrary()
 {
-    getTopEnv().symbols[sym("cons")] = makeProcedure(s_cons);
-    getTopEnv().symbols[sym("car")] = makeProcedure(s_car);
-    getTopEnv().symbols[sym("cdr")] = makeProcedure(s_cdr);
-    getTopEnv().symbols[sym("set-car!")] = makeProcedure(s_set_car);
-    getTopEnv().symbols[sym("set-cdr!")] = makeProcedure(s_set_cdr);
-    getTopEnv().symbols[sym("add2")] = makeProcedure(s_add2);
-    getTopEnv().symbols[sym("sub2")] = makeProcedure(s_sub2);
-    getTopEnv().symbols[sym("mul2")] = makeProcedure(s_mul2);
-    getTopEnv().symbols[sym("div2")] = makeProcedure(s_div2);
-    getTopEnv().symbols[sym("<")] = makeProcedure(s_lt);
-    getTopEnv().symbols[sym(">")] = makeProcedure(s_gt);
-    getTopEnv().symbols[sym("<=")] = makeProcedure(s_le);
-    getTopEnv().symbols[sym(">=")] = makeProcedure(s_ge);
-    getTopEnv().symbols[sym("=")] = makeProcedure(s_eqnum);
-    getTopEnv().symbols[sym("eq?")] = makeProcedure(s_eq);
-    getTopEnv().symbols[sym("null?")] = makeProcedure(s_null);
-    getTopEnv().symbols[sym("pair?")] = makeProcedure(s_pair);
-    getTopEnv().symbols[sym("boolean?")] = makeProcedure(s_boolean);
-    getTopEnv().symbols[sym("number?")] = makeProcedure(s_number);
-    getTopEnv().symbols[sym("symbol?")] = makeProcedure(s_symbol);
-    getTopEnv().symbols[sym("port?")] = makeProcedure(s_port);
-    getTopEnv().symbols[sym("assert")] = makeProcedure(s_assert);
-    getTopEnv().symbols[sym("error")] = makeProcedure(s_error);
-    getTopEnv().symbols[sym("apply")] = makeProcedure(s_apply);
-    getTopEnv().symbols[sym("call-with-current-continuation")] = makeProcedure(s_callcc);
-    getTopEnv().symbols[sym("write-char")] = makeProcedure(s_write_char);
-    getTopEnv().symbols[sym("stdin-port")]  = registerValue(new FILEPort(stdin, Port::READ));
-    getTopEnv().symbols[sym("stdout-port")] = registerValue(new FILEPort(stdout, Port::WRITE));
-    getTopEnv().symbols[sym("stderr-port")] = registerValue(new FILEPort(stderr, Port::WRITE));
-    getTopEnv().symbols[sym("symbol->string")] = makeProcedure(s_symbol_to_string);
-    getTopEnv().symbols[sym("string-ref")] = makeProcedure(s_string_ref);
-    getTopEnv().symbols[sym("string-length")] = makeProcedure(s_string_length);
+    define(sym("cons"), makeProcedure(s_cons));
+    define(sym("car"), makeProcedure(s_car));
+    define(sym("cdr"), makeProcedure(s_cdr));
+    define(sym("set-car!"), makeProcedure(s_set_car));
+    define(sym("set-cdr!"), makeProcedure(s_set_cdr));
+    define(sym("add2"), makeProcedure(s_add));
+    define(sym("sub2"), makeProcedure(s_sub));
+    define(sym("mul2"), makeProcedure(s_mul));
+    define(sym("div2"), makeProcedure(s_div));
+    define(sym("<"), makeProcedure(s_lt));
+    define(sym(">"), makeProcedure(s_gt));
+    define(sym("<="), makeProcedure(s_le));
+    define(sym(">="), makeProcedure(s_ge));
+    define(sym("="), makeProcedure(s_eqnum));
+    define(sym("eq?"), makeProcedure(s_eq));
+    define(sym("null?"), makeProcedure(s_null));
+    define(sym("pair?"), makeProcedure(s_pair));
+    define(sym("boolean?"), makeProcedure(s_boolean));
+    define(sym("number?"), makeProcedure(s_number));
+    define(sym("symbol?"), makeProcedure(s_symbol));
+    define(sym("port?"), makeProcedure(s_port));
+    define(sym("assert"), makeProcedure(s_assert));
+    define(sym("error"), makeProcedure(s_error));
+    define(sym("apply"), makeProcedure(s_apply));
+    define(sym("call-with-current-continuation"), makeProcedure(s_callcc));
+    define(sym("write-char"), makeProcedure(s_write_char));
+    define(sym("stdin-port"),  newValue<FILEPort>(stdin, Port::READ));
+    define(sym("stdout-port"), newValue<FILEPort>(stdout, Port::WRITE));
+    define(sym("stderr-port"), newValue<FILEPort>(stderr, Port::WRITE));
+    define(sym("symbol->string"), makeProcedure(s_symbol_to_string));
+    define(sym("string-ref"), makeProcedure(s_string_ref));
+    define(sym("string-length"), makeProcedure(s_string_length));
+    define(sym("number->string"), makeProcedure(s_number_to_string));
 }
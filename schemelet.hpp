@@ -2,10 +2,15 @@
 #pragma once
 
 #include <map>
+#include <unordered_map>
 #include <string>
 #include <vector>
 #include <stack>
 #include <cassert>
+#include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
+#include <new>
 
 namespace sl
 {
@@ -17,12 +22,28 @@ namespace sl
     struct Pair;
     struct Symbol;
     struct String;
-    struct Char;
     struct Vector;
-    struct Number;
     struct Port;
     struct Procedure;
-
+    struct Global;
+    struct Flonum;
+    struct Bignum;
+    struct TypeDescriptor;
+
+    // A Value* is either a pointer to a heap object or an immediate that is
+    // encoded in the pointer bits themselves:
+    //
+    //   ...xxx1  fixnum, the value is in the upper 63 bits
+    //   ...x010  constant: nil, #t, #f or omitted
+    //   ...x110  character, the code point is in the upper bits
+    //   ...x000  heap object
+    //
+    // Immediates must never be dereferenced. Use typeOf() instead of looking at
+    // the object, and Value::mark() to mark a value that may be an immediate.
+    //
+    // Heap objects start with a one word header and have no vtable. Marking,
+    // finalization and size queries switch on the type; ports and user types
+    // are handled through their TypeDescriptor.
     struct Value
     {
         enum Type
@@ -41,79 +62,163 @@ namespace sl
             CONTINUATION,
             ENV,
             PORT,
+            GLOBAL,
+            FLONUM,
+            BIGNUM,
             OMITTED,
             FIRST_USER_TYPE
         };
 
-        void         mark() { if (hasMark()) return; setMark(); markChildren(); }
-        virtual void markChildren() {}
+        enum
+        {
+            TAG_FIXNUM   = 1,
+            TAG_CONSTANT = 2,
+            TAG_CHAR     = 6,
+
+            NIL_BITS     = (0 << 3) | TAG_CONSTANT,
+            TRUE_BITS    = (1 << 3) | TAG_CONSTANT,
+            FALSE_BITS   = (2 << 3) | TAG_CONSTANT,
+            OMITTED_BITS = (3 << 3) | TAG_CONSTANT
+        };
 
-        Type getType() const { return (Type)type; }
+        static const long FIXNUM_MAX = (long)(~0UL >> 2);
+        static const long FIXNUM_MIN = -FIXNUM_MAX - 1;
+
+        static bool isHeap  (const Value* v) { return ((uintptr_t)v & 3) == 0; }
+        static bool isFixnum(const Value* v) { return ((uintptr_t)v & TAG_FIXNUM) != 0; }
+
+        // Marking is iterative: mark() only queues a value (and prefetches
+        // it), and traceMarks() pops values, marks them and queues their
+        // children until the mark stack is empty. With a budget it stops
+        // after marking that many values and returns false if any are left.
+        static void   mark      (Value* v) { if (!v || !isHeap(v)) return; __builtin_prefetch(v); markStack.push_back(v); }
+        static bool   traceMarks(int& budget);
+        static void   traceMarks() { int all = INT_MAX; traceMarks(all); }
+        static void   traceMarksParallel(int threads); // marks with helper threads; markChildren() must be thread safe
+        static void   finalize(Value* v); // runs the destructor of the concrete type
+        static size_t size    (Value* v); // bytes of the concrete type
+
+        void markChildren();
+        const TypeDescriptor* descriptor();
+
+        Type heapType() const { return (Type)(__atomic_load_n(&header, __ATOMIC_RELAXED) & TYPE_MASK); }
+
+        Pair*         getPair()         { assert(heapType() == PAIR); return (Pair*)this; }
+        Symbol*       getSymbol()       { assert(heapType() == SYMBOL); return (Symbol*)this; }
+        Code*         getCode()         { assert(heapType() == CODE); return (Code*)this; }
+        Env*          getEnv()          { assert(heapType() == ENV); return (Env*)this; }
+        Continuation* getContinuation() { assert(heapType() == CONTINUATION); return (Continuation*)this; }
+        Closure*      getClosure()      { assert(heapType() == CLOSURE); return (Closure*)this; }
+        Procedure*    getProcedure()    { assert(heapType() == PROCEDURE); return (Procedure*)this; }
+        Port*         getPort()         { assert(heapType() == PORT); return (Port*)this; }
+        String*       getString()       { assert(heapType() == STRING); return (String*)this; }
+        Global*       getGlobal()       { assert(heapType() == GLOBAL); return (Global*)this; }
+        Flonum*       getFlonum()       { assert(heapType() == FLONUM); return (Flonum*)this; }
+        Bignum*       getBignum()       { assert(heapType() == BIGNUM); return (Bignum*)this; }
+
+        void clearMark() { header &= ~MARK_BIT; }
+        void setMark()   { header |= MARK_BIT; }
+        bool hasMark()   { return (header & MARK_BIT) != 0; }
+
+        // Sets the mark and returns whether it was clear before. Several
+        // marking threads may race for the same value; the plain load saves
+        // the locked instruction when the value is marked already.
+        bool tryMark()
+        {
+            if (__atomic_load_n(&header, __ATOMIC_RELAXED) & MARK_BIT)
+                return false;
+            return !(__atomic_fetch_or(&header, (uint32_t)MARK_BIT, __ATOMIC_RELAXED) & MARK_BIT);
+        }
 
-        Pair*         getPair()         { assert(getType() == PAIR); return (Pair*)this; }
-        Symbol*       getSymbol()       { assert(getType() == SYMBOL); return (Symbol*)this; }
-        Code*         getCode()         { assert(getType() == CODE); return (Code*)this; }
-        Env*          getEnv()          { assert(getType() == ENV); return (Env*)this; }
-        Continuation* getContinuation() { assert(getType() == CONTINUATION); return (Continuation*)this; }
-        Closure*      getClosure()      { assert(getType() == CLOSURE); return (Closure*)this; }
-        Number*       getNumber()       { assert(getType() == NUMBER); return (Number*)this; }
-        Procedure*    getProcedure()    { assert(getType() == PROCEDURE); return (Procedure*)this; }
-        Port*         getPort()         { assert(getType() == PORT); return (Port*)this; }
-        Char*         getChar()         { assert(getType() == CHAR); return (Char*)this; }
-        String*       getString()       { assert(getType() == STRING); return (String*)this; }
+        // Marks are sticky: between collections the mark is set on exactly
+        // the values that survived a collection, the old generation.
+        bool isOld()     { return hasMark(); }
 
-        void incRef()  { refs++; assert(refs > 0); }
-        void decRef()  { assert(refs > 0); refs--; }
-        bool hasRefs() { return refs > 0; }
+    private:
+        // The header is a single word so that the mark can be set
+        // atomically: the type, the GC visited flag, the remembered flag (in
+        // the heap's remembered set) and the pinned flag.
+        enum
+        {
+            TYPE_MASK      = 0xff,
+            MARK_BIT       = 1 << 8,
+            REMEMBERED_BIT = 1 << 9,
+            PINNED_BIT     = 1 << 10 // may not be moved by Heap compaction
+        };
 
-        void clearMark() { vis = 0; }
-        void setMark()   { vis = 1; }
-        bool hasMark()   { return vis == 1; }
+        uint32_t header;
 
-    private:
-        unsigned int type : 8;
-        unsigned int vis  : 1; // GC visited flag
-        unsigned int refs : 23;
+        static thread_local std::vector<Value*> markStack;
 
     protected: // use Context to construct Values
-        Value(Type t) : type(t), vis(0), refs(0) { assert((int)type < 256); }
+        Value(Type t) : header(t) { assert((int)t < 256); }
+        Value(Value&& v) : header(v.header) {} // for Heap compaction
         Value(const Value&);
-        virtual ~Value() {}
+        ~Value() {}
         Value& operator=(const Value&) { return *this; }
 
         friend class Context;
+        friend class Heap;
     };
 
+    inline Value::Type typeOf(const Value* v)
+    {
+        uintptr_t bits = (uintptr_t)v;
+        if (bits & Value::TAG_FIXNUM)
+            return Value::NUMBER;
+        if ((bits & 7) == Value::TAG_CHAR)
+            return Value::CHAR;
+        if (bits & Value::TAG_CONSTANT)
+            return (bits == Value::NIL_BITS) ? Value::NIL : (bits == Value::OMITTED_BITS) ? Value::OMITTED : Value::BOOLEAN;
+        return v->heapType();
+    }
+
+    inline long fixnumValue(const Value* v) { assert(typeOf(v) == Value::NUMBER); return (intptr_t)v >> 1; }
+    inline int  charValue  (const Value* v) { assert(typeOf(v) == Value::CHAR); return (int)((uintptr_t)v >> 3); }
+
     struct Pair : public Value
     {
         Pair(Value* car, Value* cdr) : Value(PAIR), car(car), cdr(cdr) {}
 
         void markChildren()
         {
-            car->mark();
-            cdr->mark();
+            mark(car);
+            mark(cdr);
         }
 
         Value* car;
         Value* cdr;
     };
 
-    struct Symbol : public Value
+    // Fixnums are immediates (see Value); other numbers live on the heap.
+    struct Flonum : public Value
     {
-        Symbol(const std::string& s) : Value(SYMBOL), s(s) {}
-        std::string s;
+        Flonum(double d) : Value(FLONUM), d(d) {}
+        double d;
     };
 
-    struct Number : public Value
+    // Integers outside the fixnum range. The magnitude is stored as base 2^32
+    // digits, least significant first, without leading zeros. Results that
+    // fit a fixnum are always returned as fixnums, so a Bignum is never equal
+    // to a fixnum.
+    struct Bignum : public Value
     {
-        Number(long int v) : Value(NUMBER), v(v) {}
-        long int v;
+        Bignum(bool n, const std::vector<uint32_t>& d) : Value(BIGNUM), negative(n), digits(d) {}
+        bool                  negative;
+        std::vector<uint32_t> digits;
     };
 
-    struct Char : public Value
+    inline bool isNumber(const Value* v)
     {
-        Char(int ch) : Value(CHAR), ch(ch) {}
-        int ch;
+        return Value::isFixnum(v) || (Value::isHeap(v) && (v->heapType() == Value::FLONUM || v->heapType() == Value::BIGNUM));
+    }
+
+    std::string numberToString(Value* v);
+
+    struct Symbol : public Value
+    {
+        Symbol(const std::string& s) : Value(SYMBOL), s(s) {}
+        std::string s;
     };
 
     struct String : public Value
@@ -122,6 +227,8 @@ namespace sl
         std::string s;
     };
 
+    // Hosts that store into an existing vector must call
+    // Context::writeBarrier() afterwards.
     struct Vector : public Value
     {
         Vector() : Value(VECTOR) {}
@@ -129,7 +236,7 @@ namespace sl
         void markChildren()
         {
             for (int i = 0; i < (int)values.size(); i++)
-                values[i]->mark();
+                mark(values[i]);
         }
 
         std::vector<Value*> values;
@@ -137,53 +244,71 @@ namespace sl
 
     struct Procedure : public Value
     {
-        typedef Value* (*proctype)(Context& ctx, Value*);
+        // Arguments are passed as a view of argc values. argv is only valid
+        // until the procedure calls back into the Context.
+        typedef Value* (*proctype)(Context& ctx, int argc, Value** argv);
 
         Procedure(proctype p) : Value(PROCEDURE), proc(p) {}
 
         proctype proc;
     };
 
+    // Binding cell of a global name. Cells are created on first reference and
+    // never move, so compiled code links to them directly. An unbound cell has
+    // a null value.
+    struct Global : public Value
+    {
+        Global(Symbol* s) : Value(GLOBAL), sym(s), value(0) {}
+
+        void markChildren();
+
+        Symbol* sym;
+        Value*  value;
+    };
+
+    // Closure frames keep their bindings in a flat slot array laid out by the
+    // compiler (see Code::locals). The top level environment has no slots and
+    // binds global names through cells instead.
     struct Env : public Value
     {
-        Env(Env* p = 0) : Value(ENV), parent(p) {}
+        Env(Env* p = 0, int n = 0) : Value(ENV), parent(p), slots(n, (Value*)0) {}
 
         void markChildren()
         {
-            if (parent)
-                parent->mark();
-            for (std::map<Symbol*, Value*>::iterator iter = symbols.begin(); iter != symbols.end(); iter++)
-            {
-                iter->first->mark();
-                iter->second->mark();
-            }
+            mark(parent);
+            for (int i = 0; i < (int)slots.size(); i++)
+                mark(slots[i]);
+            // Unbound cells only live as long as some code refers to them.
+            for (std::map<Symbol*, Global*>::iterator iter = globals.begin(); iter != globals.end(); iter++)
+                if (iter->second->value)
+                    mark(iter->second);
         }
 
-        Value* findSymbol(Symbol* s) const
+        Env* up(int depth)
         {
-            if (symbols.find(s) == symbols.end())
-                return parent ? parent->findSymbol(s) : 0;
-            else
-                return symbols.find(s)->second;
+            Env* e = this;
+            while (depth-- > 0)
+                e = e->parent;
+            return e;
         }
 
-        void setSymbolLocal(Symbol* s, Value* v)
-        {
-            symbols[s] = v;
-        }
-
-        void setSymbol(Symbol* s, Value* v)
+        Value* findSymbol(Symbol* s) const
         {
-            if (parent && parent->findSymbol(s))
-                parent->setSymbol(s, v);
-            else
-                symbols[s] = v;
+            std::map<Symbol*, Global*>::const_iterator iter = globals.find(s);
+            return (iter == globals.end()) ? 0 : iter->second->value;
         }
 
-        Env*                      parent;
-        std::map<Symbol*, Value*> symbols;
+        Env*                       parent;
+        std::vector<Value*>        slots;   // 0 means unbound
+        std::map<Symbol*, Global*> globals;
     };
 
+    inline void Global::markChildren()
+    {
+        mark(sym);
+        mark(value);
+    }
+
     struct FilePos
     {
         FilePos() : f(0), p(0) {}
@@ -192,25 +317,80 @@ namespace sl
         int     p;
     };
 
+    // The interpreter's instructions, in OpType order; Context::run() builds
+    // its handler table from the same list.
+#define SL_OPS(X) \
+    X(NONE) \
+    X(LOOKUP) \
+    X(LOOKUP_LOCAL) \
+    X(PUSH) \
+    X(POP) \
+    X(APPLY) \
+    X(TAIL_APPLY) \
+    X(DEFINE) \
+    X(SET) \
+    X(SET_LOCAL) \
+    X(SKIP) \
+    X(SKIP_IF_FALSE) \
+    X(LAMBDA) \
+    X(CONS) \
+    X(SPLICING) \
+    X(RETURN) \
+    X(LOOKUP_BOX) \
+    X(SET_BOX) \
+    X(DEFINE_DISCARD) \
+    X(SET_LOCAL_DISCARD) \
+    X(LOOKUP_LOOKUP_LOCAL) \
+    X(LOOKUP_LOCAL_APPLY) \
+    X(PUSH_APPLY) \
+    X(PRIM_CAR) \
+    X(PRIM_CDR) \
+    X(PRIM_CONS) \
+    X(PRIM_EQ) \
+    X(PRIM_ADD) \
+    X(PRIM_SUB) \
+    X(PRIM_LT) \
+    X(PRIM_GT) \
+    X(PRIM_LE) \
+    X(PRIM_GE) \
+    X(PRIM_EQNUM) \
+    X(PRIM_NULL) \
+    X(PRIM_PAIR)
+
     struct Code : public Value
     {
         enum OpType
         {
-            NONE,
-            LOOKUP,
-            PUSH,
-            POP,
-            APPLY,
-            TAIL_APPLY,
-            DEFINE,
-            SET,
-            SKIP,
-            SKIP_IF_FALSE,
-            LAMBDA,
-            CONS,
-            SPLICING
+#define SL_DECLARE_OP(t) t,
+            SL_OPS(SL_DECLARE_OP)
+#undef SL_DECLARE_OP
+            NUM_OPS
         };
 
+        // LOOKUP, SET and DEFINE refer to the Global cell of the name. For
+        // LOOKUP_LOCAL and SET_LOCAL, i packs the frame depth and slot index
+        // and value is the symbol (kept for error reporting). Depth 0 is the
+        // frame's own locals and depth 1 the captures of its closure.
+        // LOOKUP_BOX and SET_BOX are the same for locals that hold a box,
+        // and work on what is in it. Every code ends with RETURN.
+        //
+        // Closures are flat: LAMBDA copies the captures of the new code from
+        // the frame into an Env of their own, which is the closure's env. A
+        // captured local that is assigned anywhere is boxed so that all
+        // copies see the same binding. A box is a pair with the value in its
+        // car, or 0 while unbound.
+        //
+        // The ops from DEFINE_DISCARD on are made by the peephole pass.
+        // DEFINE_DISCARD (also for SET) and SET_LOCAL_DISCARD do not push the
+        // result. The other ones are superinstructions: the op after them
+        // keeps its operands, and they do both ops with one dispatch.
+        //
+        // The PRIM_ ops are calls of built-in procedures by their global
+        // name, with the arguments on the stack but no callee. value is the
+        // Global cell and i is 1 in tail position. They only do the work
+        // themselves while the cell still holds the built-in procedure and
+        // the arguments are of the common types; otherwise they call what
+        // the cell holds like APPLY would.
         struct Op
         {
             OpType type;
@@ -218,13 +398,59 @@ namespace sl
             Value* value;
         };
 
-        Code() : Value(CODE), rest(0) {}
+        // The register machine runs the same code with the operands spelled
+        // out. A frame's registers are its part of the continuation stack
+        // from Frame::base on, one for each depth that the stack code
+        // reaches, so register r holds what the stack code has at depth r.
+        // An op does what it does in the stack code but writes dst and reads
+        // a and b: APPLY takes the callee from a and the arguments from the
+        // registers after it, and a PRIM_ op its arguments from a and b. POP,
+        // the _DISCARD ops and the superinstructions do not occur.
+        struct RegOp
+        {
+            OpType type;
+            int    dst, a, b;
+            int    i;
+            Value* value;
+        };
+
+        // The stack machine runs ops encoded in bytes: the type in one byte,
+        // then i if the type has one, the frame depth and slot instead for
+        // the _LOCAL ops, and the index of value in constants if the type
+        // has one, all as unsigned varints. Skips count bytes. ops and pos
+        // are the form the compiler works on and are dropped once encoded.
+        //
+        // positions has an entry for each run of ops that come from the same
+        // place, as varints of the differences to the previous entry. It is
+        // only decoded to report errors.
+
+        enum { MAX_LOCALS = 0x10000 };
+
+        static int packLocal (int depth, int slot) { return (depth << 16) | slot; }
+        static int localDepth(int i)               { return i >> 16; }
+        static int localSlot (int i)               { return i & 0xffff; }
+
+        // Machine code made from regOps once the code has been entered
+        // often enough (see Context::setJitThreshold()). It runs from the op
+        // it is given and returns the op where the interpreter goes on, or -1
+        // if the interpreter has to finish a call it made.
+        typedef int (*NativeCode)(Context* ctx, Value** r, Value** const* scopes, int entry);
+
+        Code() : Value(CODE), rest(0), onStack(false), stackDepth(0), registers(0), native(0), nativeSize(0), calls(0) {}
 
         void markChildren()
         {
             for (int i = 0; i < (int)ops.size(); i++)
-                if (ops[i].value)
-                    ops[i].value->mark();
+                mark(ops[i].value);
+            for (int i = 0; i < (int)constants.size(); i++)
+                mark(constants[i]);
+            for (int i = 0; i < (int)formals.size(); i++)
+                mark(formals[i]);
+            mark(rest);
+            for (int i = 0; i < (int)locals.size(); i++)
+                mark(locals[i]);
+            for (int i = 0; i < (int)captures.size(); i++)
+                mark(captures[i]);
         }
 
         void emit(OpType t, int i, Value* v, FilePos p)
@@ -240,8 +466,24 @@ namespace sl
 
         std::vector<Symbol*> formals;
         Symbol*              rest;
+        std::vector<Symbol*> locals; // frame layout: formals, rest, internal defines
+        std::vector<int>     boxes;  // slots of locals that hold boxes
+        std::vector<Symbol*> captures;      // free variables, the closure's env layout
+        std::vector<int>     captureFrom;   // where LAMBDA finds each in its frame, packed as for LOOKUP_LOCAL
+        std::vector<bool>    boxedCaptures; // which captures are boxes
+        bool                 onStack;    // frames keep their locals on the stack, see Continuation
+        int                  stackDepth; // the most values the stack code has on the stack
         std::vector<Op>      ops;
         std::vector<FilePos> pos;
+        std::vector<uint8_t> bytes;
+        std::vector<Value*>  constants; // every value operand of bytes and file of positions, once
+        std::vector<uint8_t> positions; // by byte
+        std::vector<RegOp>   regOps;    // made from bytes when first run on the register machine
+        std::vector<uint8_t> regPositions; // by register op
+        int                  registers;
+        NativeCode           native;
+        size_t               nativeSize;
+        int                  calls; // entries on the register machine, -1 once compiled
     };
 
     struct Closure : public Value
@@ -250,8 +492,8 @@ namespace sl
 
         void markChildren()
         {
-            env->mark();
-            code->mark();
+            mark(env);
+            mark(code);
         }
 
         Env*  env;
@@ -265,38 +507,101 @@ namespace sl
         void markChildren()
         {
             for (int i = 0; i < (int)stack.size(); i++)
-                stack[i]->mark();
+                mark(stack[i]);
             for (int i = 0; i < (int)frames.size(); i++)
             {
-                frames[i].env->mark();
-                frames[i].closure->mark();
+                mark(frames[i].env);
+                mark(frames[i].closure);
             }
         }
 
+        // A frame starts at base in the stack, where its callee was. Its
+        // locals are in env, or, when env is 0, on the stack after the
+        // callee, so that they go away with the frame. They are copied with
+        // the stack then, which framesOnStack() only allows for code that does
+        // not assign a local while it may be captured waiting for a call. The
+        // stack code's values or the registers follow.
         struct Frame
         {
-            Frame(Env* e, Closure* c) : env(e), closure(c), cp(0) {}
+            Frame(Env* e, Closure* c) : env(e), closure(c), cp(0), base(0) {}
 
             Env*     env;
             Closure* closure;
             int      cp;
+            int      base;
         };
 
         std::vector<Frame>  frames;
         std::vector<Value*> stack;
     };
 
+    // Describes a heap type that the core does not know the layout of. Types
+    // from FIRST_USER_TYPE on are registered with registerType(); ports carry
+    // their descriptor in their Port::Class. Compaction never moves these
+    // values, nor the values that their markChildren() reaches.
+    struct TypeDescriptor
+    {
+        const char* name;
+        size_t      size;
+        void      (*markChildren)(Value* v); // 0 if the type holds no values
+        void      (*finalize)(Value* v);     // 0 if there is nothing to release
+    };
+
+    void registerType(Value::Type type, const TypeDescriptor* descriptor);
+
+    template<typename T>
+    void finalizeAs(Value* v) { ((T*)v)->~T(); }
+
     struct Port : public Value
     {
         enum { READ = 1, WRITE = 2 };
 
-        Port() : Value(PORT) {}
+        struct Class : public TypeDescriptor
+        {
+            typedef int (*writetype)(Port* port, const void* b, int s);
+            typedef int (*readtype) (Port* port, void* b, int s);
 
-        virtual int write(const void*, int) = 0;
-        virtual int read(void*, int) = 0;
-        virtual int mode() = 0;
+            Class(const char* n, size_t sz, void (*mc)(Value*), void (*f)(Value*), writetype w, readtype r) : write(w), read(r)
+            {
+                name = n;
+                size = sz;
+                markChildren = mc;
+                finalize = f;
+            }
+
+            writetype write;
+            readtype  read;
+        };
+
+        Port(const Class* c, int m) : Value(PORT), cls(c), m(m) {}
+
+        int write(const void* b, int s) { return cls->write(this, b, s); }
+        int read (void* b, int s)       { return cls->read(this, b, s); }
+        int mode()                      { return m; }
+
+        const Class* cls;
+        int          m;
     };
 
+    // Symbols that the parser, compiler and interpreter refer to directly.
+    // They are interned once per Context and kept alive by the collector.
+#define SL_KEYWORDS(X) \
+    X(symBegin,               "begin") \
+    X(symQuote,               "quote") \
+    X(symQuasiquote,          "quasiquote") \
+    X(symUnquote,             "unquote") \
+    X(symUnquoteSplicing,     "unquote-splicing") \
+    X(symSet,                 "set!") \
+    X(symDefine,              "define") \
+    X(symLambda,              "lambda") \
+    X(symIf,                  "if") \
+    X(symDot,                 ".") \
+    X(symMacroExpander,       "macro-expander") \
+    X(symUndefinedIdentifier, "undefined-identifier") \
+    X(symBadArgumentCount,    "bad-argument-count") \
+    X(symBadArgumentType,     "bad-argument-type") \
+    X(symBadSyntax,           "bad-syntax")
+
     struct Error
     {
         Error() : sym(0), param(0), continuation(0) {}
@@ -306,6 +611,199 @@ namespace sl
         Continuation* continuation;
     };
 
+    // Per-Context storage for heap values. Values are carved out of aligned
+    // pages, and every page holds cells of a single C++ type whose size is
+    // rounded up to a size class, so values of one type sit next to each
+    // other. A pool allocates by bumping through its newest page and reuses
+    // the cells that the last sweep put on its free list.
+    //
+    // Values allocated since the last collection are young and listed, so a
+    // minor collection can sweep them without walking the pages. Old values
+    // that were made to point at young ones are kept in the remembered set.
+    //
+    // A full collection clears every mark, marks from the roots and sweeps
+    // the pages. Each phase can run to completion or a budget of work at a
+    // time; between increments the pending marks are kept in the heap.
+    class Heap
+    {
+    public:
+        enum { PAGE_SIZE = 64 * 1024, CHUNK_PAGES = 32, SIZE_CLASS = 8 };
+
+        Heap();
+        ~Heap();
+
+        template<typename T>
+        void* allocate()
+        {
+            static const int index = nextPoolIndex();
+            if (index >= (int)pools.size() || !pools[index].cellSize)
+                createPool(index, sizeof(T));
+
+            Pool& pool = pools[index];
+            live++;
+            liveBytes += pool.cellSize;
+            allocated += pool.cellSize;
+            void* v;
+            if (FreeCell* c = pool.freeList)
+            {
+                pool.freeList = c->next;
+                v = c;
+            }
+            else if (pool.current && pool.current->bump + pool.cellSize <= pool.current->end)
+            {
+                v = pool.current->bump;
+                pool.current->bump += pool.cellSize;
+            }
+            else
+                v = allocateSlow(index);
+            young.push_back((Value*)v);
+            return v;
+        }
+
+        void remember(Value* v) { if (!(v->header & Value::REMEMBERED_BIT)) { v->header |= Value::REMEMBERED_BIT; remembered.push_back(v); } }
+
+        // Full collection. A work unit is one cell cleared or swept; the
+        // *Some() functions subtract what they did from budget and return
+        // true once the phase is done.
+        void startClear();
+        bool clearSome(int& budget); // clears marks
+        void startSweep();
+        bool sweepSome(int& budget); // destroys unmarked values; the survivors become old
+        bool isSweeping() const { return sweepPool >= 0; }
+
+        // Marks queued by an unfinished increment are parked here, so that
+        // other collections can use the mark stack in between.
+        void resumeMarking()  { assert(Value::markStack.empty()); Value::markStack.swap(gray); }
+        void suspendMarking() { assert(gray.empty()); Value::markStack.swap(gray); }
+        void discardMarking() { gray.clear(); }
+
+        // Minor collection.
+        void markRemembered(); // queues the children of remembered values and forgets them
+        void sweepYoung();     // destroys unmarked young values; the survivors become old
+
+        const std::vector<Value*>& youngValues() const { return young; }
+
+        // Compaction, after a full mark. Live values are moved to fresh pages
+        // in the order forward() reaches them, depth first and cdr first, so
+        // list spines end up contiguous. Values that cannot be moved are
+        // pinned where they are.
+        void startCompaction();         // pins the values that cannot move
+        void forward(Value** slot);     // moves *slot and everything it reaches
+        void forward(Symbol** slot)     { forward((Value**)slot); }
+        void finishCompaction();        // frees the old pages
+
+        int    count()          const { return live; }
+        int    pages()          const { return pageCount; }
+        size_t bytes()          const { return liveBytes; } // cell sizes, without what the values own
+        size_t allocatedBytes() const { return allocated; } // ever, only grows
+
+    private:
+        // A cell on a free list. Its header has type FREE, so sweep can tell
+        // free cells from live ones. A cell that compaction moved a value out
+        // of has type FORWARDED and the new address in next.
+        enum { FREE = 0xff, FORWARDED = 0xfe };
+
+        struct FreeCell
+        {
+            uint64_t  header;
+            FreeCell* next;
+        };
+
+        struct Page
+        {
+            Page* next;
+            char* bump;  // end of the cells handed out so far
+            char* end;
+            int   size;  // bytes, PAGE_SIZE or more for large cells
+            int   pool;  // index in pools
+            char* cells() { return (char*)this + ((sizeof(Page) + SIZE_CLASS - 1) & ~(SIZE_CLASS - 1)); }
+        };
+
+        struct Pool
+        {
+            Pool() : cellSize(0), pages(0), current(0), freeList(0), unswept(0), from(0) {}
+            int       cellSize;
+            Page*     pages;
+            Page*     current;
+            FreeCell* freeList;
+            Page*     unswept; // pages the running sweep has not reached yet
+            Page*     from;    // pages the running compaction moves values out of
+        };
+
+        static int nextPoolIndex();
+
+        void  createPool  (int index, size_t size);
+        void* allocateSlow(int index);
+        void* allocateIn  (int index); // for compaction: no free list, not counted
+        void  pushSlots   (Value* v);
+        Page* newPage     (int index);
+        void  freePage    (Page* page);
+
+        // Pages are PAGE_SIZE aligned, and a large cell is the only cell on
+        // its page, so every cell finds its page by masking its address.
+        static Page* pageOf(void* p) { return (Page*)((uintptr_t)p & ~(uintptr_t)(PAGE_SIZE - 1)); }
+
+        std::vector<Pool>   pools;
+        std::vector<Value*> young;      // allocated since the last collection
+        std::vector<Value*> remembered; // old values that may point at young ones
+        std::vector<Value*> gray;       // marks queued between increments
+        int                 clearPool;  // position of the running clear
+        Page*               clearPage;
+        int                 sweepPool;  // position of the running sweep, -1 if none
+        std::vector<Value**> slots;     // references the running compaction has to update
+        std::vector<Value*>  pinned;
+        std::vector<Env*>    rehash;    // environments whose globals are keyed by moved symbols
+        std::vector<void*>  chunks;     // PAGE_SIZE pages are carved out of these
+        Page*              spare;  // empty PAGE_SIZE pages ready for reuse
+        int                pageCount;
+        int                live;
+        size_t             liveBytes;
+        size_t             allocated;
+
+        Heap(const Heap&);
+        Heap& operator=(const Heap&);
+    };
+
+    // A host reference to a value. Handles are the roots the collector
+    // starts from besides the Context's own, and compaction updates them
+    // when it moves their values. They link themselves into their Context
+    // and must not outlive it.
+    class HandleBase
+    {
+    public:
+        Value* getValue() const { return value; }
+
+    protected:
+        inline HandleBase(Context& ctx, Value* v);
+        HandleBase(const HandleBase& h) : value(h.value) { linkAfter(const_cast<HandleBase*>(&h)); }
+        ~HandleBase() { prev->next = next; next->prev = prev; }
+        HandleBase& operator=(const HandleBase& h) { value = h.value; return *this; }
+
+        Value* value;
+
+    private:
+        HandleBase() : value(0), prev(this), next(this) {} // a Context's list head
+        void linkAfter(HandleBase* h) { prev = h; next = h->next; next->prev = this; h->next = this; }
+
+        HandleBase* prev;
+        HandleBase* next;
+
+        friend class Context;
+    };
+
+    template<typename T>
+    class Handle : public HandleBase
+    {
+    public:
+        Handle(Context& ctx, T* v = 0) : HandleBase(ctx, v) {}
+
+        Handle& operator=(T* v) { value = v; return *this; }
+
+        T* get()        const { return (T*)value; }
+        operator T*()   const { return get(); }
+        T* operator->() const { return get(); }
+    };
+
     class Context
     {
     public:
@@ -314,6 +812,18 @@ namespace sl
 
         Value* execute(const char* s, Symbol* file = 0);
 
+        void   define(Symbol* s, Value* v) { Global* g = global(s); g->value = v; writeBarrier(g, v); writeBarrier(topEnv, g); }
+
+        // Must be called after v is stored into a field of holder, unless
+        // holder was allocated after the last collection. The interpreter
+        // does this for pairs, environments, global cells and the current
+        // continuation; hosts do it for values they mutate themselves.
+        void writeBarrier(Value* holder, Value* v)
+        {
+            if (holder->isOld() && v && Value::isHeap(v) && !v->isOld())
+                heap.remember(holder);
+        }
+
         Env& getTopEnv() { return *topEnv->getEnv(); }
         Continuation* getCurrentContinuation() { return currentContinuation; }
 
@@ -322,60 +832,188 @@ namespace sl
         Value* macroExpand  (Value* v, const std::map<Value*, FilePos>& pos, std::map<Value*, FilePos>& pos2);
         Code*  compile      (Value* v, const std::map<Value*, FilePos>& pos);
 
-        void apply(Value* callee, Value* args);
+        void apply(Value* callee, int argc, Value** argv);
 
         bool         hasError  () const                     { return error.sym != 0; }
         const Error& getError  () const                     { return error; }
         void         clearError()                           { assert(hasError()); error = Error(); }
         void         setError  (Symbol* id, Value* p, Continuation* c) { assert(!hasError()); error.sym = id; error.param = p; error.continuation = c; }
+        FilePos      getErrorPos() const; // where the code that raised the error comes from, if known
 
         Symbol* sym    (const std::string& s);
         Symbol* symCase(const std::string& s);
-        Value*  nil    () { return &nilValue; }
-        Value*  t      () { return &trueValue; }
-        Value*  f      () { return &falseValue; }
-        Value*  omitted() { return &omittedValue; }
-
-        void gc();
-
-        Pair*  makePair               (Value* a, Value* b)    { return registerValue(new Pair(a, b)); }
-        Value*        makeInteger     (int i)                 { return registerValue(new Number(i)); }
-        Value*        makeNumber      (double d)              { return registerValue(new Number(d)); }
-        Value*        makeProcedure   (Procedure::proctype p) { return registerValue(new Procedure(p)); }
+        Value*  nil    () { return (Value*)Value::NIL_BITS; }
+        Value*  t      () { return (Value*)Value::TRUE_BITS; }
+        Value*  f      () { return (Value*)Value::FALSE_BITS; }
+        Value*  omitted() { return (Value*)Value::OMITTED_BITS; }
+
+        // The interpreter collects on its own when it makes a call, where
+        // everything live is reachable from the continuation: a minor
+        // collection after every nursery size bytes allocated, and a full one
+        // once the old generation has grown by the growth factor over the bytes live
+        // after the last full one (or the nursery size, if that is more).
+        // That full collection is incremental. It is paced to finish before
+        // the heap has grown by as much again, so every byte allocated
+        // meanwhile owes some work units (values marked or cells cleared or
+        // swept). The work is paid at most INCREMENT_BYTES apart, and no
+        // increment does more than the budget: a number of work units and,
+        // if micros is not 0, about that many microseconds. A small budget
+        // makes increments more frequent instead. Only the final remark of
+        // the roots and the symbol tables is not bounded, and a cycle that
+        // still falls behind by twice its allowance is finished at once.
+        enum { NURSERY_BYTES = 8 * 1024 * 1024, INCREMENT_BYTES = 128 * 1024 };
+
+        void gc();      // full collection, finishes an incremental one first
+        void compact(); // full collection that also moves values together; not while code runs
+        void minorGC(); // collects only the values allocated since the last collection
+        void setIncrementBudget(int work, int micros = 0) { incrementWork = work > 0 ? work : 1; incrementMicros = micros; }
+        void setNurserySize(size_t bytes) { nurseryBytes = bytes; } // 0 turns automatic collection off
+        void setHeapGrowth(double factor) { heapGrowth = factor > 1 ? factor : 1; }
+
+        // gc() marks with this many threads, 1 by default. Minor and
+        // incremental collections always mark on the calling thread.
+        void setMarkThreads(int n) { markThreads = n > 0 ? n : 1; }
+
+        // Code runs on the stack machine by default. The register machine
+        // runs it translated to ops with register operands. Errors and
+        // continuations work the same on both, but a continuation captured
+        // on one must not be resumed on the other, so switch only between
+        // executions.
+        enum Backend { STACK_MACHINE, REGISTER_MACHINE };
+        void    setBackend(Backend b) { backend = b; }
+        Backend getBackend() const    { return backend; }
+
+        // On x86-64, the register machine compiles code to machine code once
+        // it has been entered this many times. 0, the default, turns the
+        // JIT off, also for code that is compiled already.
+        void setJitThreshold(int calls) { jitThreshold = calls > 0 ? calls : 0; }
+
+        // Has the JIT append a line to /tmp/perf-<pid>.map for each code it
+        // compiles from now on, so that perf can name the machine code. Off
+        // by default; the file stays open until this is turned off again.
+        void setPerfMap(bool on);
+
+        // When built with SL_OP_HISTOGRAM, run() counts how often each op
+        // follows each other one, in all Contexts together. This prints the
+        // most frequent pairs to stdout; otherwise it does nothing.
+        static void printOpPairs(int max = 40);
+        bool isCollecting() const { return phase != IDLE; }
+        int    getValueCount() const { return heap.count(); }
+        size_t getHeapBytes()  const { return heap.bytes(); }
+
+        Pair*  makePair               (Value* a, Value* b)    { return newValue<Pair>(a, b); }
+        Value*        makeInteger     (long i)                { return (i >= Value::FIXNUM_MIN && i <= Value::FIXNUM_MAX) ? (Value*)(((uintptr_t)i << 1) | Value::TAG_FIXNUM) : makeBignum(i); }
+        Value*        makeBignum      (long i);
+        Value*        makeBignum      (bool negative, const std::vector<uint32_t>& digits);
+        Value*        makeNumber      (double d)              { return newValue<Flonum>(d); }
+        Value*        makeProcedure   (Procedure::proctype p) { return newValue<Procedure>(p); }
         Value*        makeBoolean     (bool b)                { return b ? t() : f(); }
-        Value*        makeString      (const std::string& s)  { return registerValue(new String(s)); }
-        Value*        makeChar        (int ch)                { return registerValue(new Char(ch)); }
-        Continuation* makeContinuation()                      { return registerValue(new Continuation()); }
+        Value*        makeString      (const std::string& s)  { return newValue<String>(s); }
+        Value*        makeChar        (int ch)                { return (Value*)(((uintptr_t)ch << 3) | Value::TAG_CHAR); }
+        Continuation* makeContinuation()                      { return newValue<Continuation>(); }
+
+        // Allocates a value of any type, including ports and registered user
+        // types.
+        template<typename T, typename... A>
+        T* newValue(A&&... a)
+        {
+            T* v = new (heap.allocate<T>()) T(a...);
+            if (heap.isSweeping())
+                v->setMark(); // allocated black, the sweep may not have reached it
+            return v;
+        }
 
     private:
-        Env*   makeEnv         (Env* p)          { return registerValue(new Env(p)); }
-        Code*  makeCode        ()                { return registerValue(new Code()); }
-        Closure* makeClosure   (Env* e, Code* c) { return registerValue(new Closure(e, c)); }
-        Value* makeValue       (Value::Type t)   { return registerValue(new Value(t)); }
-        template<typename T>
-        T* registerValue       (T* v)            { valuesSinceLastGC++; values.push_back(v); return v; }
+        Env*   makeEnv         (Env* p, int n)   { return newValue<Env>(p, n); }
+        Code*  makeCode        ()                { return newValue<Code>(); }
+        Closure* makeClosure   (Env* e, Code* c) { return newValue<Closure>(e, c); }
+        Closure* makeFlatClosure(Value** const* scopes, Code* c);
+        Global* global         (Symbol* s);
+
+        // Compile time view of the enclosing lambdas, innermost first.
+        struct Scope
+        {
+            Scope(const Scope* p, Code* c) : parent(p), code(c) {}
+            const Scope* parent;
+            Code*        code; // gets the captures that are found
+        };
 
-        void compileBegin     (Code& c, Value* v, const std::map<Value*, FilePos>& pos);
-        void compile          (Code& c, Value* v, const std::map<Value*, FilePos>& pos);
-        bool compileQuasiquote(Code& c, Value* v, const std::map<Value*, FilePos>& pos);
+        void compileBegin     (Code& c, const Scope* s, Value* v, const std::map<Value*, FilePos>& pos);
+        void compile          (Code& c, const Scope* s, Value* v, const std::map<Value*, FilePos>& pos);
+        bool compileQuasiquote(Code& c, const Scope* s, Value* v, const std::map<Value*, FilePos>& pos);
+        void collectDefines   (Code& c, Value* v);
+        enum { USE_ASSIGNED = 1, USE_CAPTURED = 2 };
+        void scanUses         (Value* v, bool nested, std::map<Symbol*, int>& uses);
+        void findBoxes        (Code& c, Value* body);
+        bool resolveLocal     (const Scope* s, Symbol* sym, int& i, bool& boxed);
 
         Value* annotate(Value* v, const std::map<Value*, FilePos>& pos);
         Value* unannotate(Value* v, std::map<Value*, FilePos>& pos);
 
-        void step(Continuation* c);
-        Continuation::Frame applyClosure(Closure* c, Value* args);
+        struct FoldHash  { size_t operator()(const std::string& s) const; };
+        struct FoldEqual { bool operator()(const std::string& a, const std::string& b) const; };
+        typedef std::unordered_map<std::string, Symbol*>                     SymbolTable;
+        typedef std::unordered_map<std::string, Symbol*, FoldHash, FoldEqual> FoldedSymbolTable;
+
+        Symbol* intern(const std::string& s);
+        void    pruneSymbols();
+
+        // Phases of an incremental full collection.
+        enum Phase { IDLE, CLEARING, MARKING, SWEEPING };
+
+        void markRoots     ();
+        void markYoungRoots(int from);
+        void pruneTables   ();
+        int  increment     (int work, int micros);
+        void collect       ();
+        void run         (Continuation* c);
+        void runStack    (Continuation* c);
+        void runRegisters(Continuation* c);
+        void compileNative(Code* code);
+        static bool nativeOp(Context* ctx, const Code::RegOp* op, Value** r, Value** const* scopes);
+        static int  nativeApply(Context* ctx, const Code::RegOp* op, Value** r);
+        bool collectionDue() const
+        {
+            size_t allocated = heap.allocatedBytes() - allocatedAtLastGC;
+            return nurseryBytes && allocated >= (phase == IDLE ? nurseryBytes : incrementBytes);
+        }
+        Continuation::Frame applyClosure(std::vector<Value*>& st, int base, int argc);
 
         void initStandardLibrary();
 
         Env*                 topEnv;
-        Value                nilValue;
-        Value                trueValue;
-        Value                falseValue;
-        Value                omittedValue;
         Error                error;
-        std::vector<Symbol*> symbols;
-        std::vector<Value*>  values;
-        int                  valuesSinceLastGC;
+        SymbolTable          symbols;       // exact spelling
+        FoldedSymbolTable    foldedSymbols; // case-folded spelling
+        Heap                 heap;
+        size_t               allocatedAtLastGC; // heap.allocatedBytes() then
+        size_t               liveBytesAfterFullGC;
+        size_t               nurseryBytes;
+        double               heapGrowth;
+        Phase                phase;
+        int                  youngScanned;    // young values already checked for roots by this phase
+        double               workPerByte;     // what the running full collection owes per byte allocated
+        size_t               incrementBytes;  // allocated between its increments
+        size_t               cycleLimit;      // heap bytes past which it is finished at once
+        int                  incrementWork;
+        int                  incrementMicros;
+        int                  markThreads;
+        Backend              backend;
+        int                  jitThreshold;
+        FILE*                perfMap;
         Continuation*        currentContinuation;
+        std::vector<Value*>  argBuffer; // arguments of the procedure being called from run(), a root
+        HandleBase           handles;
+
+#define SL_DECLARE_KEYWORD(m, s) Symbol* m;
+        SL_KEYWORDS(SL_DECLARE_KEYWORD)
+#undef SL_DECLARE_KEYWORD
+
+        friend class HandleBase;
     };
+
+    inline HandleBase::HandleBase(Context& ctx, Value* v) : value(v)
+    {
+        linkAfter(&ctx.handles);
+    }
 }
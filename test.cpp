@@ -9,7 +9,7 @@ void printValue(Context& ctx, Value* v, int in)
     for (int i = 0; i < in; i++)
         printf("  ");
 
-    switch (v->getType())
+    switch (typeOf(v))
     {
         case Value::NIL:
             printf("nil\n");
@@ -34,7 +34,15 @@ void printValue(Context& ctx, Value* v, int in)
             break;
 
         case Value::NUMBER:
-            printf("num %ld\n", v->getNumber()->v);
+            printf("num %ld\n", fixnumValue(v));
+            break;
+
+        case Value::FLONUM:
+            printf("flo %g\n", v->getFlonum()->d);
+            break;
+
+        case Value::BIGNUM:
+            printf("num %s\n", numberToString(v).c_str());
             break;
 
         case Value::CLOSURE:
@@ -46,39 +54,215 @@ void printValue(Context& ctx, Value* v, int in)
             break;
 
         default:
-            printf("FASDFASD %d\n", v->getType());
+            printf("FASDFASD %d\n", typeOf(v));
             break;
     }
 }
 
-static Value* display(Context& ctx, Value* v)
+static Value* display(Context& ctx, int, Value** argv)
+{
+    printf("DISPLAY\n");
+    printValue(ctx, argv[0], 2);
+    return ctx.nil();
+}
+
+static Value* newline(Context& ctx, int, Value**)
+{
+    printf("NEWLINE\n");
+    return ctx.nil();
+}
+
+static Value* frameDepth(Context& ctx, int, Value**)
+{
+    return ctx.makeInteger(ctx.getCurrentContinuation()->frames.size());
+}
+
+static Value* gc(Context& ctx, int, Value**)
+{
+    ctx.gc();
+    return ctx.nil();
+}
+
+static Value* minorGC(Context& ctx, int, Value**)
+{
+    ctx.minorGC();
+    return ctx.nil();
+}
+
+// Collects, fills the freed cells and gives back its argument, which only
+// the call itself holds on to.
+static Value* gcReturning(Context& ctx, int, Value** argv)
+{
+    ctx.gc();
+    for (int i = 0; i < 100000; i++)
+        ctx.makePair(ctx.makeInteger(7), ctx.makeInteger(7));
+    return argv[0];
+}
+
+static Value* setMarkThreads(Context& ctx, int, Value** argv)
+{
+    ctx.setMarkThreads(fixnumValue(argv[0]));
+    return ctx.nil();
+}
+
+static Value* setNurserySize(Context& ctx, int, Value** argv)
+{
+    ctx.setNurserySize(fixnumValue(argv[0]));
+    return ctx.nil();
+}
+
+static Value* setIncrementBudget(Context& ctx, int, Value** argv)
+{
+    ctx.setIncrementBudget(fixnumValue(argv[0]));
+    return ctx.nil();
+}
+
+static Value* setHeapGrowth(Context& ctx, int, Value** argv)
+{
+    ctx.setHeapGrowth(typeOf(argv[0]) == Value::FLONUM ? argv[0]->getFlonum()->d : fixnumValue(argv[0]));
+    return ctx.nil();
+}
+
+// The error-* procedures run a program in a Context of its own, on the same
+// machine, and tell about the error it raises: where it is reported, its
+// name and what it carries. Each returns nil if there was none.
+static Context::Backend backend = Context::STACK_MACHINE;
+static int jitThreshold = 0;
+
+static void runAside(Context& sub, Value* program)
 {
-    if (v->getType() == Value::STRING)
+    sub.setBackend(backend);
+    sub.setJitThreshold(jitThreshold);
+    sub.execute(program->getString()->s.c_str(), sub.sym("aside"));
+}
+
+static Value* errorOffset(Context& ctx, int, Value** argv)
+{
+    Context sub;
+    runAside(sub, argv[0]);
+    if (!sub.hasError() || !sub.getErrorPos().f)
+        return ctx.nil();
+    return ctx.makeInteger(sub.getErrorPos().p);
+}
+
+static Value* errorName(Context& ctx, int, Value** argv)
+{
+    Context sub;
+    runAside(sub, argv[0]);
+    if (!sub.hasError())
+        return ctx.nil();
+    return ctx.sym(sub.getError().sym->s);
+}
+
+// Copies what an error carries, as far as it is made of pairs, symbols and
+// immediates.
+static Value* copyParam(Context& ctx, Value* v)
+{
+    switch (typeOf(v))
     {
-        printf("%s", v->getString()->s.c_str());
+        case Value::PAIR:
+            return ctx.makePair(copyParam(ctx, v->getPair()->car), copyParam(ctx, v->getPair()->cdr));
+
+        case Value::SYMBOL:
+            return ctx.sym(v->getSymbol()->s);
+
+        default:
+            return Value::isHeap(v) ? ctx.sym("unknown") : v;
     }
-    else
+}
+
+static Value* errorParam(Context& ctx, int, Value** argv)
+{
+    Context sub;
+    runAside(sub, argv[0]);
+    if (!sub.hasError() || !sub.getError().param)
+        return ctx.nil();
+    return copyParam(ctx, sub.getError().param);
+}
+
+// Sets an error named by a symbol that nothing else refers to in a Context
+// of its own, collects, compacts and interns other symbols, and tells the
+// error's name then.
+static Value* errorNameAfterGC(Context& ctx, int, Value** argv)
+{
+    Context sub;
+    sub.setError(sub.sym(argv[0]->getSymbol()->s), sub.nil(), 0);
+    sub.gc();
+    sub.compact();
+    for (int i = 0; i < 1000; i++)
     {
-        printf("DISPLAY\n");
-        printValue(ctx, v->getPair()->car, 2);
+        char name[32];
+        snprintf(name, sizeof(name), "other-%d", i);
+        sub.sym(name);
     }
-    return ctx.nil();
+    return ctx.sym(sub.getError().sym->s);
 }
 
-static Value* newline(Context& ctx, Value*)
+// A value that only the host refers to, through a Handle.
+static Handle<Value>* keptValue;
+
+static Value* handleSet(Context& ctx, int, Value** argv)
 {
-    printf("NEWLINE\n");
+    *keptValue = argv[0];
     return ctx.nil();
 }
 
+static Value* handleRef(Context&, int, Value**)
+{
+    return *keptValue;
+}
+
+static Value* heapSize(Context& ctx, int, Value**)
+{
+    return ctx.makeInteger(ctx.getValueCount());
+}
+
 int main(int argc, char* argv[])
 {
     Context ctx;
-    ctx.getTopEnv().symbols[ctx.sym("display")] = ctx.makeProcedure(display);
-    ctx.getTopEnv().symbols[ctx.sym("newline")] = ctx.makeProcedure(newline);
+    ctx.define(ctx.sym("display"), ctx.makeProcedure(display));
+    ctx.define(ctx.sym("newline"), ctx.makeProcedure(newline));
+    ctx.define(ctx.sym("frame-depth"), ctx.makeProcedure(frameDepth));
+    ctx.define(ctx.sym("gc"), ctx.makeProcedure(gc));
+    ctx.define(ctx.sym("minor-gc"), ctx.makeProcedure(minorGC));
+    ctx.define(ctx.sym("gc-returning"), ctx.makeProcedure(gcReturning));
+    ctx.define(ctx.sym("set-mark-threads"), ctx.makeProcedure(setMarkThreads));
+    ctx.define(ctx.sym("set-nursery-size"), ctx.makeProcedure(setNurserySize));
+    ctx.define(ctx.sym("set-increment-budget"), ctx.makeProcedure(setIncrementBudget));
+    ctx.define(ctx.sym("set-heap-growth"), ctx.makeProcedure(setHeapGrowth));
+    ctx.define(ctx.sym("heap-size"), ctx.makeProcedure(heapSize));
+    ctx.define(ctx.sym("error-offset"), ctx.makeProcedure(errorOffset));
+    ctx.define(ctx.sym("error-name"), ctx.makeProcedure(errorName));
+    ctx.define(ctx.sym("error-param"), ctx.makeProcedure(errorParam));
+    ctx.define(ctx.sym("error-name-after-gc"), ctx.makeProcedure(errorNameAfterGC));
+    ctx.define(ctx.sym("handle-set!"), ctx.makeProcedure(handleSet));
+    ctx.define(ctx.sym("handle-ref"), ctx.makeProcedure(handleRef));
+
+    Handle<Value> keptHandle(ctx, ctx.nil());
+    keptValue = &keptHandle;
 
     for (int i = 1; i < argc; i++)
     {
+        if (!strcmp(argv[i], "--registers"))
+        {
+            backend = Context::REGISTER_MACHINE;
+            ctx.setBackend(backend);
+            continue;
+        }
+        if (!strcmp(argv[i], "--jit"))
+        {
+            backend = Context::REGISTER_MACHINE;
+            jitThreshold = 1;
+            ctx.setBackend(backend);
+            ctx.setJitThreshold(jitThreshold);
+            continue;
+        }
+        if (!strcmp(argv[i], "--perf-map"))
+        {
+            ctx.setPerfMap(true);
+            continue;
+        }
+
         char buffer[1024*16];
         memset(buffer, 0, sizeof(buffer));
         FILE* fp = fopen(argv[i], "rt");
@@ -91,6 +275,9 @@ int main(int argc, char* argv[])
         if (ctx.hasError())
         {
             printf("ERROR %s:\n", ctx.getError().sym->s.c_str());
+            FilePos pos = ctx.getErrorPos();
+            if (pos.f)
+                printf("  at %s:%d\n", pos.f->s.c_str(), pos.p);
             if (ctx.getError().param)
                 printValue(ctx, ctx.getError().param, 1);
             return 0;
@@ -100,10 +287,14 @@ int main(int argc, char* argv[])
             printf("RET FROM '%s' =>\n", argv[i]);
             printValue(ctx, ret, 2);
         }
+
+        // Later files run on a compacted heap.
+        ctx.compact();
     }
 
     if (ctx.hasError())
         ctx.clearError();
 
     ctx.gc();
+    Context::printOpPairs();
 }
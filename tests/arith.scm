@@ -8,3 +8,23 @@
 (assert (= (*) 1))
 (assert (= (* 2) 2))
 (assert (= (* 2 3) 6))
+
+(assert (= (+ 1.5 2.5) 4))
+(assert (= (* 2 0.5) 1))
+(assert (= (- 1 0.25) 0.75))
+(assert (= (div2 1 4) 0))
+(assert (= (div2 1.0 4) 0.25))
+(assert (< 1 1.5 ))
+(assert (> -0.5 -1))
+(assert (number? 3.25))
+(assert (number? -.5))
+
+(define (fact n) (if (< n 2) 1 (* n (fact (- n 1)))))
+
+(assert (= (- (+ 4611686018427387903 1) 1) 4611686018427387903))
+(assert (= (* 99999999999 99999999999) 9999999999800000000001))
+(assert (= (div2 (fact 30) (fact 29)) 30))
+(assert (= (div2 (* (fact 400) (fact 300)) (fact 300)) (fact 400)))
+(assert (= (- (fact 25) (fact 25)) 0))
+(assert (< (- 0 (fact 25)) (fact 20)))
+(assert (> 1e30 (fact 20)))
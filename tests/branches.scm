@@ -0,0 +1,53 @@
+(define (assert x) (if (not x) (display "failed") '()))
+
+; Branches on constants are folded by the compiler, and the skips around
+; them have to land where they did before.
+
+(assert (= (if #t 1 2) 1))
+(assert (= (if #f 1 2) 2))
+(assert (= (if '() 1 2) 1))
+(assert (= (if 0 1 2) 1))
+(assert (null? (if #f 1)))
+
+(define (pick x)
+  (if x (if #f 'no (if #t 'yes 'no)) (if #t (if x 'no 'else) 'no)))
+
+(assert (eq? (pick #t) 'yes))
+(assert (eq? (pick #f) 'else))
+
+; Nested ifs whose branches end the lambda, with calls in tail position.
+
+(define (classify n)
+  (if (< n 0)
+    'negative
+    (if (= n 0)
+      'zero
+      (if (< n 10) (begin 'ignored 'small) 'large))))
+
+(assert (eq? (classify -5) 'negative))
+(assert (eq? (classify 0) 'zero))
+(assert (eq? (classify 3) 'small))
+(assert (eq? (classify 30) 'large))
+
+; Definitions and assignments whose value is thrown away.
+
+(define counter 0)
+(define (bump) (set! counter (+ counter 1)) (set! counter (+ counter 1)) counter)
+(bump)
+(assert (= (bump) 4))
+
+(define (local-defines x)
+  (define a (+ x 1))
+  (define b (+ a 1))
+  (set! a (+ a b))
+  a)
+
+(assert (= (local-defines 1) 5))
+
+; Calls whose last argument is a local or a constant.
+
+(define (add3 a b c) (+ a (+ b c)))
+(define (f x) (add3 x x x))
+(define (g x) (add3 x 1 2))
+(assert (= (f 2) 6))
+(assert (= (g 2) 5))
@@ -0,0 +1,92 @@
+(define (assert x) (if (not x) (display "failed") '()))
+
+; Closures copy the variables they capture; assigned ones are shared
+; through boxes.
+
+(define (make-counter)
+  (define n 0)
+  (cons (lambda () (set! n (+ n 1)) n)
+        (lambda () n)))
+
+(define c1 (make-counter))
+(define c2 (make-counter))
+((car c1))
+((car c1))
+((car c2))
+(assert (= ((cdr c1)) 2))
+(assert (= ((cdr c2)) 1))
+
+; A formal assigned in the body after a lambda captured it, and one
+; assigned through two levels of lambdas.
+
+(define (late x)
+  (define get (lambda () x))
+  (set! x (* x 10))
+  (get))
+(assert (= (late 4) 40))
+
+(define (outer x)
+  (lambda (y)
+    (lambda ()
+      (set! x (+ x y))
+      x)))
+(define add-3 ((outer 1) 3))
+(add-3)
+(assert (= (add-3) 7))
+
+; Internal defines that refer to each other before they are bound.
+
+(define (parity n)
+  (define (even? n) (if (= n 0) #t (odd? (- n 1))))
+  (define (odd? n) (if (= n 0) #f (even? (- n 1))))
+  (even? n))
+(assert (parity 10))
+(assert (not (parity 7)))
+
+; A variable from several levels out, and a rest list.
+
+(define (deep a)
+  (lambda (b)
+    (lambda (c)
+      (lambda rest (+ a b c (car rest))))))
+(assert (= ((((deep 1) 2) 3) 4) 10))
+
+(define (collect . items)
+  (lambda (x) (set! items (cons x items)) items))
+(define more (collect 1 2))
+(more 3)
+(assert (= (car (more 4)) 4))
+
+; Reading an internal define before it is bound is still an error, so its
+; box starts out empty; a closure that only reads its copy sees the value.
+
+(define (snapshot x)
+  (define f (lambda () x))
+  f)
+(assert (= ((snapshot 5)) 5))
+
+; A small closure made by a function with a large local keeps only what it
+; uses alive.
+
+(define (iota-list i acc)
+  (if (= i 0) acc (iota-list (- i 1) (cons i acc))))
+
+(define (make-small n)
+  (define big (iota-list 100000 '()))
+  (lambda () (+ n (car big) -1)))
+
+(define (make-tiny n)
+  (define big (iota-list 100000 '()))
+  (if (pair? big) (lambda () n) '()))
+
+(define before (begin (gc) (heap-size)))
+(define tiny (make-tiny 7))
+(define after (begin (gc) (heap-size)))
+(assert (= (tiny) 7))
+(assert (< after (+ before 1000)))
+(assert (= ((make-small 7)) 7))
+
+; A lambda with an empty body returns nil.
+
+(assert (null? ((lambda ()))))
+(assert (null? (((lambda (x) (lambda ())) 1))))
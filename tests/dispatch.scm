@@ -0,0 +1,31 @@
+(define (assert x) (if (not x) (display "failed") '()))
+
+; Running off the end of a code returns nil.
+
+(assert (null? (if #f 1)))
+(assert (null? ((lambda (x) (if x 1)) #f)))
+
+; Errors raised between calls are reported at the op that raised them, not
+; at the last call.
+
+(assert (= (error-offset "(define f (lambda () (add2 1 2) nope)) (f)") 32))
+(assert (= (error-offset "(define f (lambda (x) (add2 (car x) (cdr x)) (car (cdr x)))) (f (cons 1 2))") 46))
+
+; Collections happen at calls and keep the locals of the running frames,
+; whether they live on the stack or in the heap.
+
+(set-nursery-size 4096)
+(define (churn n acc)
+  (if (= n 0) acc (churn (- n 1) (cons n acc))))
+(define (on-stack a b)
+  (churn 2000 '())
+  (+ (car a) (cdr b)))
+(define (in-heap a)
+  (define b (cons a a))
+  (churn 2000 '())
+  (define c (lambda () (+ (car b) (cdr b))))
+  (churn 2000 '())
+  (c))
+(assert (= (on-stack (cons 1 2) (cons 3 4)) 5))
+(assert (= (in-heap 21) 42))
+(set-nursery-size 8388608)
@@ -0,0 +1,24 @@
+(define (assert x) (if (not x) (display "failed") '()))
+
+; Operands that do not fit in one byte: locals in high slots, frames deep
+; up, skips over long branches and codes with many constants.
+
+(define (many-locals a0 a1 a2 a3 a4 a5 a6 a7 a8 a9 a10 a11 a12 a13 a14 a15 a16 a17 a18 a19 a20 a21 a22 a23 a24 a25 a26 a27 a28 a29 a30 a31 a32 a33 a34 a35 a36 a37 a38 a39)
+  (add2 a0 (add2 a17 a39)))
+(assert (= (many-locals 0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 21 22 23 24 25 26 27 28 29 30 31 32 33 34 35 36 37 38 39) 56))
+
+(define (same-list? a b)
+  (if (null? a) (null? b) (if (= (car a) (car b)) (same-list? (cdr a) (cdr b)) #f)))
+
+(define (deep a)
+  (lambda (b) (lambda (c) (lambda (d) (lambda (e) (lambda (f) (lambda (g) (lambda (h) (lambda (i) (lambda (j) (list a b c d e f g h i j)))))))))))
+(assert (same-list? ((((((((((deep 1) 2) 3) 4) 5) 6) 7) 8) 9) 10) '(1 2 3 4 5 6 7 8 9 10)))
+
+(define (long-branch x)
+  (define n 0)
+  (if x (begin (set! n (add2 n 0)) (set! n (add2 n 1)) (set! n (add2 n 2)) (set! n (add2 n 3)) (set! n (add2 n 4)) (set! n (add2 n 5)) (set! n (add2 n 6)) (set! n (add2 n 7)) (set! n (add2 n 8)) (set! n (add2 n 9)) (set! n (add2 n 10)) (set! n (add2 n 11)) (set! n (add2 n 12)) (set! n (add2 n 13)) (set! n (add2 n 14)) (set! n (add2 n 15)) (set! n (add2 n 16)) (set! n (add2 n 17)) (set! n (add2 n 18)) (set! n (add2 n 19)) (set! n (add2 n 20)) (set! n (add2 n 21)) (set! n (add2 n 22)) (set! n (add2 n 23)) (set! n (add2 n 24)) (set! n (add2 n 25)) (set! n (add2 n 26)) (set! n (add2 n 27)) (set! n (add2 n 28)) (set! n (add2 n 29)) (set! n (add2 n 30)) (set! n (add2 n 31)) (set! n (add2 n 32)) (set! n (add2 n 33)) (set! n (add2 n 34)) (set! n (add2 n 35)) (set! n (add2 n 36)) (set! n (add2 n 37)) (set! n (add2 n 38)) (set! n (add2 n 39)) (set! n (add2 n 40)) (set! n (add2 n 41)) (set! n (add2 n 42)) (set! n (add2 n 43)) (set! n (add2 n 44)) (set! n (add2 n 45)) (set! n (add2 n 46)) (set! n (add2 n 47)) (set! n (add2 n 48)) (set! n (add2 n 49)) (set! n (add2 n 50)) (set! n (add2 n 51)) (set! n (add2 n 52)) (set! n (add2 n 53)) (set! n (add2 n 54)) (set! n (add2 n 55)) (set! n (add2 n 56)) (set! n (add2 n 57)) (set! n (add2 n 58)) (set! n (add2 n 59)) n) 'short))
+(assert (= (long-branch #t) 1770))
+(assert (eq? (long-branch #f) 'short))
+
+(define many-constants (list 's0 's1 's2 's3 's4 's5 's6 's7 's8 's9 's10 's11 's12 's13 's14 's15 's16 's17 's18 's19 's20 's21 's22 's23 's24 's25 's26 's27 's28 's29 's30 's31 's32 's33 's34 's35 's36 's37 's38 's39 's40 's41 's42 's43 's44 's45 's46 's47 's48 's49 's50 's51 's52 's53 's54 's55 's56 's57 's58 's59 's60 's61 's62 's63 's64 's65 's66 's67 's68 's69 's70 's71 's72 's73 's74 's75 's76 's77 's78 's79 's80 's81 's82 's83 's84 's85 's86 's87 's88 's89 's90 's91 's92 's93 's94 's95 's96 's97 's98 's99 's100 's101 's102 's103 's104 's105 's106 's107 's108 's109 's110 's111 's112 's113 's114 's115 's116 's117 's118 's119 's120 's121 's122 's123 's124 's125 's126 's127 's128 's129 's130 's131 's132 's133 's134 's135 's136 's137 's138 's139 's140 's141 's142 's143 's144 's145 's146 's147 's148 's149 's150 's151 's152 's153 's154 's155 's156 's157 's158 's159 's160 's161 's162 's163 's164 's165 's166 's167 's168 's169 's170 's171 's172 's173 's174 's175 's176 's177 's178 's179 's180 's181 's182 's183 's184 's185 's186 's187 's188 's189 's190 's191 's192 's193 's194 's195 's196 's197 's198 's199))
+(assert (eq? (car (cdr many-constants)) 's1))
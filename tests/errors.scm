@@ -0,0 +1,27 @@
+(define (assert x) (if (not x) (display "failed") '()))
+
+; An error is reported at the call that raised it, just inside its opening
+; parenthesis, not at the end of the arguments.
+
+(assert (= (error-offset "(define f (lambda (x) (add2 (car x) 1))) (f 1)") 29))
+(assert (= (error-offset "(define f (lambda (x) (add2 (f (cdr x)) 1))) (f '(1 2))") 32))
+(assert (null? (error-offset "(car '(1))")))
+
+; A call in tail position drops its frame, but a procedure that fails there
+; is still reported at the call.
+
+(assert (= (error-offset "(define h (lambda (x) (car x))) (h 1)") 23))
+(assert (= (error-offset "(define h (lambda (x) (apply car (cons x '())))) (h 1)") 23))
+(assert (= (error-offset "(car 1)") 1))
+
+; A call with the wrong number of arguments fails at the call with the
+; arguments left over, or nil if there were too few.
+
+(assert (= (error-offset "(define f (lambda (x y) x)) (add2 (f 1 2 3) 1)") 35))
+(assert (null? (error-param "(define f (lambda (x y) x)) (f 1)")))
+(assert (null? (error-param "(define f (lambda (x . r) x)) (f)")))
+(define extra (error-param "(define f (lambda (x y) x)) (f 1 2 3 4)"))
+(assert (= (car extra) 3))
+(assert (= (car (cdr extra)) 4))
+(assert (null? (cdr (cdr extra))))
+(assert (= (car (error-param "((lambda () (call-with-current-continuation (lambda (k) (k 1 2)))))")) 2))
@@ -0,0 +1,52 @@
+(define (assert x) (if (not x) (display "failed") '()))
+
+; Frames that no continuation can share keep their locals on the stack.
+; Deep recursion through them, and calls made with apply and rest lists.
+
+(define (count-up n)
+  (if (= n 0) 0 (+ 1 (count-up (- n 1)))))
+(assert (= (count-up 10000) 10000))
+
+(define (sum . xs)
+  (if (null? xs) 0 (+ (car xs) (apply sum (cdr xs)))))
+(assert (= (apply sum (list 1 2 3 4)) 10))
+(assert (= (sum) 0))
+
+(define (spread a b . rest)
+  (lambda () (+ a b (car rest))))
+(assert (= ((apply spread (list 1 2 3))) 6))
+
+; Such frames allocate nothing; add2 and sub2 take no rest list.
+
+(define (walk n)
+  (if (= n 0) 0 (add2 (walk (sub2 n 1)) n)))
+(walk 10)
+(define before (heap-size))
+(walk 1000)
+(define after (heap-size))
+(assert (< after (+ before 100)))
+
+; A continuation captured under a stack frame still sees its variables
+; when it is resumed after the frame has returned.
+
+(define saved '())
+(define (on-stack a b)
+  (+ a b (call-with-current-continuation (lambda (k) (set! saved k) 0))))
+
+(define hits 0)
+(define (resume)
+  (define r (on-stack 1 2))
+  (set! hits (+ hits 1))
+  (if (< hits 3) (saved hits) r))
+(assert (= (resume) 5))
+
+; A frame that assigns a local and makes a call stays in the heap, so every
+; resumption of a continuation sees the last assignment.
+
+(define (count-resumes)
+  (define n 0)
+  (define k '())
+  (define got (call-with-current-continuation (lambda (c) (set! k c) 0)))
+  (set! n (+ n 1))
+  (if (< got 3) (k (+ got 1)) n))
+(assert (= (count-resumes) 4))
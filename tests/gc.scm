@@ -0,0 +1,164 @@
+(define (assert x) (if (not x) (display "failed") '()))
+
+; Collecting long structures must not overflow the C stack.
+
+(define (iota-list i acc)
+  (if (= i 0)
+    acc
+    (iota-list (- i 1) (cons i acc))))
+
+(define (list-length l n)
+  (if (pair? l) (list-length (cdr l) (+ n 1)) n))
+
+(define long-list (iota-list 1000000 '()))
+(gc)
+(assert (= (list-length long-list 0) 1000000))
+(assert (= (car long-list) 1))
+
+; A list of lists, so the cars hold pairs too.
+
+(define nested (iota-list 1000 '()))
+(define (wrap l i)
+  (if (= i 0) l (wrap (cons l (cons i '())) (- i 1))))
+(define wrapped (wrap nested 100000))
+(gc)
+(assert (= (list-length wrapped 0) 2))
+
+; A deep chain of closures and environments.
+
+(define (nest i k)
+  (if (= i 0) k (nest (- i 1) (lambda () k))))
+
+(define (unnest k n)
+  (if (symbol? k) n (unnest (k) (+ n 1))))
+
+(define chain (nest 1000000 'end))
+(gc)
+(assert (= (unnest chain 0) 1000000))
+
+(set! long-list '())
+(set! wrapped '())
+(set! chain '())
+(gc)
+(assert (< (heap-size) 100000))
+
+; Minor collections keep young values that only old ones refer to.
+
+(define (garbage i)
+  (if (= i 0) '() (begin (cons i i) (garbage (- i 1)))))
+
+(define old-pair (cons 1 2))
+(define (box-of v) (lambda (x) (if x (set! v x) v)))
+(define old-box (box-of 0))
+(gc)
+
+(set-car! old-pair (cons 3 4))
+(set-cdr! old-pair (cons 5 6))
+(old-box (cons 7 8))
+(define young-global (cons 9 10))
+(minor-gc)
+(garbage 1000)
+(minor-gc)
+(assert (= (car (car old-pair)) 3))
+(assert (= (car (cdr old-pair)) 5))
+(assert (= (car (old-box #f)) 7))
+(assert (= (car young-global) 9))
+
+; and free the young values that nothing refers to.
+
+(define before (heap-size))
+(garbage 10000)
+(minor-gc)
+(assert (< (heap-size) (+ before 1000)))
+
+; Parallel marking finds the same values.
+
+(define long-list (iota-list 100000 '()))
+(define chain (nest 10000 'end))
+(define count-before (begin (gc) (heap-size)))
+(set-mark-threads 4)
+(gc)
+(assert (= (heap-size) count-before))
+(assert (= (list-length long-list 0) 100000))
+(assert (= (unnest chain 0) 10000))
+(set-mark-threads 1)
+
+; Without explicit collections the heap stays bounded, both for garbage
+; that dies young and for lists that live long enough to be promoted.
+
+(set! long-list '())
+(set! chain '())
+(set-nursery-size 65536)
+(define before (begin (gc) (heap-size)))
+(garbage 100000)
+(assert (< (heap-size) (+ before 50000)))
+
+(define kept '())
+(define (churn i)
+  (if (= i 0) '() (begin (set! kept (iota-list 10000 '())) (churn (- i 1)))))
+(churn 50)
+(assert (< (heap-size) (+ before 100000)))
+(assert (= (list-length kept 0) 10000))
+
+; The same with a small increment budget and little room to grow: each full
+; collection then takes many increments, which must still keep up.
+
+(set-increment-budget 64)
+(set-heap-growth 1.2)
+(set! kept '())
+(define before (begin (gc) (heap-size)))
+(churn 50)
+(assert (< (heap-size) (+ before 100000)))
+(assert (= (list-length kept 0) 10000))
+(set-increment-budget 65536)
+(set-heap-growth 2)
+(set-nursery-size 8388608)
+
+; Values of every type keep their contents while the cells around them are
+; freed and reused.
+
+(define (churn-types i)
+  (if (= i 0)
+    '()
+    (begin
+      (cons i i) (+ i 0.5) (* i 100000000000000000000) (number->string i) (lambda () i)
+      (churn-types (- i 1)))))
+
+(define (nth l i) (if (= i 0) (car l) (nth (cdr l) (- i 1))))
+
+(define survivors
+  (list (cons 1 2) 2.5 (* 3 100000000000000000000) (number->string 4) (lambda () 5) 'six))
+(churn-types 1000)
+(gc)
+(churn-types 1000)
+(minor-gc)
+(churn-types 1000)
+(gc)
+(assert (= (car (nth survivors 0)) 1))
+(assert (= (cdr (nth survivors 0)) 2))
+(assert (= (nth survivors 1) 2.5))
+(assert (= (nth survivors 2) 300000000000000000000))
+(assert (eq? (string-ref (nth survivors 3) 0) #\4))
+(assert (= ((nth survivors 4)) 5))
+(assert (eq? (nth survivors 5) 'six))
+
+; A value that only a host handle refers to survives collections, young or
+; old, and is freed once the handle lets go of it.
+
+(handle-set! (iota-list 10000 '()))
+(minor-gc)
+(garbage 1000)
+(gc)
+(assert (= (list-length (handle-ref) 0) 10000))
+(define with-kept (heap-size))
+(handle-set! '())
+(gc)
+(assert (< (heap-size) (- with-kept 9000)))
+
+; The arguments of a procedure are only held by the call, also when the
+; procedure collects and the freed cells are used again before it returns.
+
+(assert (= (car (gc-returning (cons 1 2))) 1))
+(define (pass-through x) (add2 (car (gc-returning (cons x 2))) 0))
+(assert (= (pass-through 1) 1))
+(assert (= (pass-through 3) 3))
@@ -0,0 +1,47 @@
+(define (assert x) (if (not x) (display "failed") '()))
+
+; Code refers to globals through their binding cells, so code that ran
+; before a global was rebound sees the new value, whether it reads the
+; global, calls it or passes it a local.
+
+(define g 1)
+(define (get-g) g)
+(define (call-h x) (h x))
+(define (h x) (+ x 1))
+
+(define (read-many i sum)
+  (if (= i 0) sum (read-many (- i 1) (+ sum (get-g) (call-h 0)))))
+(assert (= (read-many 10 0) 20))
+
+(set! g 2)
+(assert (= (get-g) 2))
+(define g 3)
+(assert (= (get-g) 3))
+(set! h (lambda (x) (+ x 10)))
+(assert (= (call-h 1) 11))
+(define (h x) (+ x 100))
+(assert (= (read-many 10 0) 1030))
+
+(define (set-g v) (set! g v))
+(set-g 4)
+(assert (= (get-g) 4))
+
+; A global referred to before it is defined.
+
+(define (get-later) later)
+(define later 'ok)
+(assert (eq? (get-later) 'ok))
+
+; set! of a global that was never defined binds it, as it always has.
+
+(set! never-defined 5)
+(assert (= never-defined 5))
+
+; Reading a global that is not bound is still an error, also when its cell
+; exists because other code refers to it, or when it is called.
+
+(assert (eq? (error-name "(define f (lambda () nope)) (f)") 'undefined-identifier))
+(assert (eq? (error-param "(define f (lambda () nope)) (f)") 'nope))
+(assert (eq? (error-name "(define f (lambda (x) (nope x))) (f 1)") 'undefined-identifier))
+(assert (eq? (error-name "(define f (lambda () later)) (f) (define later 1)") 'undefined-identifier))
+(assert (null? (error-name "(define f (lambda () later)) (define later 1) (f)")))
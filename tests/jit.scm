@@ -0,0 +1,90 @@
+(define (assert x) (if (not x) (display "failed") '()))
+
+(define (same-list? a b)
+  (if (null? a) (null? b) (if (eq? (car a) (car b)) (same-list? (cdr a) (cdr b)) #f)))
+
+; Hot code with --jit runs as machine code, which leaves the ops it does not
+; do itself to the interpreter and goes on after them.
+
+; Sums that overflow fixnums halfway through, and sums of flonums.
+
+(define (sum-to i acc)
+  (if (= i 0) acc (sum-to (- i 1) (+ acc i))))
+
+(assert (= (sum-to 1000 0) 500500))
+(define big 4611686018427387000)
+(define (add-many x i)
+  (if (= i 0) x (add-many (+ x 100) (- i 1))))
+(assert (= (add-many big 10) (+ big 1000)))
+(assert (> (add-many big 10) big))
+(assert (= (add-many 0.5 4) 400.5))
+
+; Type tests and list walking on every kind of value.
+
+(define (classify x)
+  (if (null? x) 'null (if (pair? x) 'pair (if (eq? x #t) 'true 'other))))
+
+(define (classify-all l acc)
+  (if (null? l) acc (classify-all (cdr l) (cons (classify (car l)) acc))))
+
+(assert (same-list? (classify-all (list '() (cons 1 2) #t #f 3 "s" 'x #\a 1.5) '())
+                '(other other other other other other true pair null)))
+
+; Closures, assignment to locals and globals, and splicing.
+
+(define counter 0)
+(define (make-adder n) (lambda (x) (set! counter (+ counter 1)) (+ x n)))
+(define (count-up n)
+  (define k 0)
+  (define (step i) (if (< i n) (begin (set! k (+ k ((make-adder 2) 0))) (step (+ i 1))) k))
+  (step 0))
+(assert (= (count-up 100) 200))
+(assert (= counter 100))
+
+(define (spread l) `(a ,@l b))
+(define (spread-many i) (if (= i 0) (spread '(1 2)) (begin (spread '(x)) (spread-many (- i 1)))))
+(assert (same-list? (spread-many 50) '(a 1 2 b)))
+
+; A built-in that is redefined after the code using it was compiled. The
+; other built-ins are only used with car put back, as some use car.
+
+(define (first-of l) (car l))
+(define (firsts i) (if (= i 0) (first-of '(1 2)) (begin (first-of '(1 2)) (firsts (- i 1)))))
+(assert (= (firsts 100) 1))
+(define saved-car car)
+(set! car (lambda (l) 7))
+(define after (first-of '(1 2)))
+(set! car saved-car)
+(assert (= after 7))
+(assert (= (firsts 100) 1))
+
+; Machine code calls procedures itself and goes on with their results. It
+; leaves the rest of a call to the interpreter when the procedure changes
+; the frames, fails or allocates enough for a collection.
+
+(define (products i acc)
+  (if (= i 0) acc (products (- i 1) (cons (mul2 i (string-length (number->string i))) acc))))
+(assert (same-list? (products 12 '()) '(1 2 3 4 5 6 7 8 9 20 22 24)))
+(set-nursery-size 4096)
+(assert (same-list? (products 12 '()) '(1 2 3 4 5 6 7 8 9 20 22 24)))
+(set-nursery-size 8388608)
+
+(define (through-apply l) (add2 1 (apply mul2 l)))
+(define (through-closure l) (add2 1 (apply (lambda (a b) (sub2 a b)) l)))
+(define (through-callcc x) (add2 1 (call-with-current-continuation (lambda (k) (k x)))))
+(define (calls i acc)
+  (if (= i 0) acc
+      (calls (- i 1) (add2 acc (add2 (through-apply (list i 2)) (add2 (through-closure (list i 1)) (through-callcc i)))))))
+(assert (= (calls 10 0) 240))
+
+(define (keep-across x)
+  (define y (cons x x))
+  (gc)
+  (minor-gc)
+  (add2 (car x) (cdr (car y))))
+(define (collect-many i acc)
+  (if (= i 0) acc (collect-many (- i 1) (add2 acc (keep-across (cons i i))))))
+(assert (= (collect-many 10 0) 110))
+
+(assert (= (error-offset "(define f (lambda (x) (mul2 x 2) (string-length x) x)) (f 1)") 34))
+(assert (= (error-offset "(define f (lambda (x) (mul2 2 2) (string-length x) x)) (f (symbol->string 's)) (f 1)") 34))
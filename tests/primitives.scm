@@ -0,0 +1,45 @@
+(define (assert x) (if (not x) (display "failed") '()))
+
+; Calls of built-in procedures by name are compiled to their own ops.
+
+(define (first l) (car l))
+(define (rest l) (cdr l))
+(define (both a b) (cons a b))
+(assert (= (first '(1 2)) 1))
+(assert (= (car (rest '(1 2))) 2))
+(assert (eq? (car (both 'a 'b)) 'a))
+(assert (eq? (eq? 'a 'a) #t))
+(assert (null? '()))
+(assert (not (null? '(1))))
+(assert (pair? '(1)))
+(assert (not (pair? 1)))
+(assert (< 1 2))
+(assert (> 2 1))
+(assert (<= 2 2))
+(assert (>= 2 2))
+(assert (not (= 1 2)))
+
+; Results that leave the fixnum range and non-fixnum operands take the
+; procedure's own path.
+
+(define big 4611686018427387903)
+(assert (= (sub2 (add2 big 1) 1) big))
+(assert (< big (add2 big 1)))
+(assert (= (add2 1.5 1.5) 3))
+(assert (< 1 1.5))
+
+; Redefining a name takes effect in code compiled before, in tail position
+; as well.
+
+(define saved-car car)
+(set! car (lambda (l) 'mine))
+(assert (eq? (first '(1 2)) 'mine))
+(set! car saved-car)
+(assert (= (first '(1 2)) 1))
+
+(define saved= =)
+(set! = (lambda (a b) (if (saved= a b) (frame-depth) (= (sub2 a 1) b))))
+(define shallow (= 10 0))
+(define deep (= 10000 0))
+(set! = saved=)
+(assert (= shallow deep))
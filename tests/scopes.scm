@@ -0,0 +1,38 @@
+(define (assert x) (if (not x) (display "failed") '()))
+
+; A variable refers to the innermost lambda that binds it, as a formal or
+; by an internal define, whatever globals or outer lambdas use the name.
+
+(define x 'global)
+(define (formal x) x)
+(assert (= (formal 1) 1))
+(assert (eq? x 'global))
+
+(define (nested x)
+  (lambda (y)
+    (lambda (x) (cons x y))))
+(assert (= (car (((nested 1) 2) 3)) 3))
+(assert (= (cdr (((nested 1) 2) 3)) 2))
+
+(define (inner-define)
+  (define x 'inner)
+  x)
+(assert (eq? (inner-define) 'inner))
+(assert (eq? x 'global))
+
+(define (bump x) (set! x (+ x 1)) x)
+(assert (= (bump 1) 2))
+(assert (eq? x 'global))
+
+; Formals named like global procedures, built-in ones included, are called
+; as the formals.
+
+(define (call-list list) (list 5))
+(assert (= (call-list (lambda (v) (+ v 1))) 6))
+(define (call-car car) (car 1))
+(assert (= (call-car (lambda (v) (+ v 2))) 3))
+
+; An internal define read before it is bound is an error.
+
+(assert (eq? (error-name "(define f (lambda () (define a b) (define b 1) a)) (f)") 'undefined-identifier))
+(assert (eq? (error-param "(define f (lambda () (define a b) (define b 1) a)) (f)") 'b))
@@ -0,0 +1,28 @@
+(define (assert x) (if (not x) (display "failed") '()))
+
+; Symbols are interned without regard to case and keep the spelling they
+; were first read with. The special forms are recognized in any case.
+
+(assert (eq? 'Folded 'FOLDED))
+(assert (eq? 'folded 'Folded))
+(assert (eq? (string-ref (symbol->string 'fOLDED) 0) #\F))
+(assert (= ((LAMBDA (x) (IF x 1 2)) #t) 1))
+(DEFINE upper 'ok)
+(assert (eq? Upper 'ok))
+
+; A collection drops the symbols nothing refers to from the tables but
+; keeps the others, so interning a name again finds the same symbol.
+
+(define kept 'kept-after-gc)
+(error-name "(error 'dropped-after-gc 0)")
+(gc)
+(assert (eq? (error-name "(error 'kept-after-gc 0)") kept))
+(assert (eq? (error-name "(error 'KEPT-after-gc 0)") kept))
+(define dropped (error-name "(error 'dropped-after-gc 0)"))
+(minor-gc)
+(assert (eq? (error-name "(error 'Dropped-After-Gc 0)") dropped))
+(assert (eq? (string-ref (symbol->string dropped) 0) #\d))
+
+; The name of a pending error is kept, also when nothing else refers to it.
+
+(assert (eq? (error-name-after-gc 'unique-error-42) 'unique-error-42))
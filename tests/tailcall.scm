@@ -0,0 +1,57 @@
+(define (assert x) (if (not x) (display "failed") '()))
+
+; Self tail call. Collects every 10000 iterations and returns the frame
+; depth at the end along with the largest heap seen after a collection.
+
+(define (loop i chunk peak)
+  (if (= i 0)
+    (cons (frame-depth) peak)
+    (if (= chunk 0)
+      (begin
+        (gc)
+        (loop (- i 1) 10000 (if (> (heap-size) peak) (heap-size) peak)))
+      (loop (- i 1) (- chunk 1) peak))))
+
+(define short (loop 10001 10000 0))
+(define long (loop 1000000 10000 0))
+
+(assert (= (car long) (car short)))
+(assert (< (cdr long) (+ (cdr short) 100)))
+
+; Mutual tail calls through begin and if.
+
+(define (even? i)
+  (if (= i 0) #t (odd? (- i 1))))
+
+(define (odd? i)
+  (begin
+    'ignored
+    (if (= i 0) #f (even? (- i 1)))))
+
+(assert (even? 10000))
+
+; Tail calls through a native procedure and a continuation.
+
+(define (apply-loop i)
+  (if (= i 0)
+    (frame-depth)
+    (apply apply-loop (list (- i 1)))))
+
+(assert (= (apply-loop 10000) (apply-loop 1)))
+
+(define (callcc-loop i)
+  (if (= i 0)
+    (frame-depth)
+    (call-with-current-continuation
+      (lambda (k)
+        (callcc-loop (- i 1))))))
+
+(assert (= (callcc-loop 10000) (callcc-loop 1)))
+
+(define (escape-loop i k)
+  (if (= i 0)
+    (k (frame-depth))
+    (escape-loop (- i 1) k)))
+
+(assert (= (call-with-current-continuation (lambda (k) (escape-loop 10000 k)))
+           (call-with-current-continuation (lambda (k) (escape-loop 1 k)))))